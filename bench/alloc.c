@@ -0,0 +1,69 @@
+#include "bench.h"
+#include "safe_blocks.h"
+
+/*
+ * malloc/free latency outside and inside a safe block. Inside, frees are
+ * only requests and the collections they trigger are part of the cost.
+ */
+
+#define OPS 1000000
+#define BATCH 1024
+
+static const size_t sizes[] = {16, 64, 256, 1024, 4096};
+static void *batch[BATCH];
+
+/* malloc directly followed by free */
+static void bench_pairs(const char *name, size_t size)
+{
+	uint64_t start = bench_now();
+	for (size_t i = 0; i < OPS; i++) {
+		void *p = malloc(size);
+		bench_escape(p);
+		free(p);
+	}
+	bench_report(name, size, OPS, bench_now() - start, 0);
+}
+
+/* BATCH blocks live at once, timed separately for malloc and free */
+static void bench_batch(const char *malloc_name, const char *free_name,
+			size_t size)
+{
+	uint64_t malloc_ns = 0, free_ns = 0;
+	for (size_t round = 0; round < OPS / BATCH; round++) {
+		uint64_t start = bench_now();
+		for (size_t i = 0; i < BATCH; i++) {
+			batch[i] = malloc(size);
+		}
+		uint64_t mid = bench_now();
+		for (size_t i = 0; i < BATCH; i++) {
+			free(batch[i]);
+		}
+		free_ns += bench_now() - mid;
+		malloc_ns += mid - start;
+	}
+	size_t ops = OPS / BATCH * BATCH;
+	bench_report(malloc_name, size, ops, malloc_ns, 0);
+	bench_report(free_name, size, ops, free_ns, 0);
+}
+
+static void run(int safe)
+{
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (safe) {
+			bench_pairs("malloc_free_safe", sizes[i]);
+			bench_batch("malloc_safe", "free_safe", sizes[i]);
+		} else {
+			bench_pairs("malloc_free_unsafe", sizes[i]);
+			bench_batch("malloc_unsafe", "free_unsafe", sizes[i]);
+		}
+	}
+}
+
+int main()
+{
+	run(0);
+
+	ENTER_SAFE_BLOCK;
+	run(1);
+	EXIT_SAFE_BLOCK;
+}
@@ -0,0 +1,55 @@
+#ifndef BENCH_H
+#define BENCH_H
+#define _GNU_SOURCE
+
+/*
+ * shared by the microbenchmarks. Every measurement is one row, printed as
+ * CSV (default) or as a JSON object per line with BENCH_FORMAT=json. The
+ * columns are label,bench,param,ops,ns_per_op,ns_max, ns_max is 0 when the
+ * operations aren't timed one by one.
+ * BENCH_LABEL tags the rows, e.g. with the runtime version, so that runs
+ * can be compared.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static inline uint64_t bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* keeps the compiler from dropping a result or a store */
+static inline void bench_escape(void *p)
+{
+	__asm__ volatile("" : : "g"(p) : "memory");
+}
+
+static inline void bench_report(const char *bench, uint64_t param,
+				 uint64_t ops, uint64_t ns, uint64_t ns_max)
+{
+	const char *label = getenv("BENCH_LABEL");
+	const char *format = getenv("BENCH_FORMAT");
+	double per_op = ops == 0 ? 0 : (double)ns / ops;
+	if (label == NULL) {
+		label = "";
+	}
+	if (format != NULL && strcmp(format, "json") == 0) {
+		printf("{\"label\": \"%s\", \"bench\": \"%s\", \"param\": %lu, "
+		       "\"ops\": %lu, \"ns_per_op\": %.2f, \"ns_max\": %lu}\n",
+		       label, bench, (unsigned long)param, (unsigned long)ops,
+		       per_op, (unsigned long)ns_max);
+	} else {
+		printf("%s,%s,%lu,%lu,%.2f,%lu\n", label, bench,
+		       (unsigned long)param, (unsigned long)ops, per_op,
+		       (unsigned long)ns_max);
+	}
+	fflush(stdout);
+}
+
+#endif
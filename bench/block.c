@@ -0,0 +1,25 @@
+#include "bench.h"
+#include "safe_blocks.h"
+
+/*
+ * enter_safe_block/exit_safe_block round trip, the first one registers the
+ * thread and is reported on its own
+ */
+
+#define OPS 1000000
+
+int main()
+{
+	uint64_t start = bench_now();
+	ENTER_SAFE_BLOCK;
+	EXIT_SAFE_BLOCK;
+	uint64_t first = bench_now() - start;
+	bench_report("enter_exit_first", 0, 1, first, first);
+
+	start = bench_now();
+	for (size_t i = 0; i < OPS; i++) {
+		ENTER_SAFE_BLOCK;
+		EXIT_SAFE_BLOCK;
+	}
+	bench_report("enter_exit", 0, OPS, bench_now() - start, 0);
+}
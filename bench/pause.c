@@ -0,0 +1,89 @@
+#include "bench.h"
+#include "safe_blocks.h"
+#include "stats.h"
+#include <unistd.h>
+
+/*
+ * stop-the-world pause against the number of live objects (pause live) and
+ * against the size of the root segments (pause roots, built once per
+ * ROOT_KB). Pauses are read from the stats page of this very process.
+ */
+
+#ifndef ROOT_KB
+#define ROOT_KB 0
+#endif
+#define ROOT_WORDS (ROOT_KB * 1024 / sizeof(uintptr_t))
+#define PAUSES 16
+#define ROOTS_LIVE 10000
+
+struct node_s {
+	struct node_s *next;
+	uintptr_t payload[3];
+};
+
+/* writable data the collector scans on every cycle */
+static uintptr_t roots[ROOT_WORDS + 1];
+static struct node_s *head;
+static size_t live;
+
+static void grow(size_t cnt)
+{
+	for (; live < cnt; live++) {
+		struct node_s *n = malloc(sizeof(*n));
+		n->next = head;
+		head = n;
+	}
+}
+
+/* churns garbage until PAUSES more collections ran, one at a time */
+static void measure(const struct gc_stats_s *st, const char *name,
+		    uint64_t param)
+{
+	uint64_t total = 0, max = 0;
+	for (size_t i = 0; i < PAUSES; i++) {
+		uint64_t cnt = st->pause_cnt;
+		uint64_t ns = st->pause_ns_total;
+		while (st->pause_cnt == cnt) {
+			void *p = malloc(16);
+			bench_escape(p);
+			free(p);
+		}
+		ns = st->pause_ns_total - ns;
+		total += ns;
+		if (ns > max) {
+			max = ns;
+		}
+	}
+	bench_report(name, param, PAUSES, total, max);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2 ||
+	    (strcmp(argv[1], "live") != 0 && strcmp(argv[1], "roots") != 0)) {
+		fprintf(stderr, "usage: %s live|roots\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const struct gc_stats_s *st = stats_map(getpid());
+	if (st == NULL) {
+		perror("pause: stats_map, preloaded with SAFE_GC_STATS=1?");
+		return EXIT_FAILURE;
+	}
+	/* fault the root pages in, with words that don't point anywhere */
+	for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); i++) {
+		roots[i] = i;
+	}
+
+	ENTER_SAFE_BLOCK;
+	if (strcmp(argv[1], "roots") == 0) {
+		grow(ROOTS_LIVE);
+		measure(st, "pause_roots", ROOT_KB * 1024);
+	} else {
+		for (size_t cnt = 1000; cnt <= 1000000; cnt *= 10) {
+			grow(cnt);
+			measure(st, "pause_live", cnt);
+		}
+	}
+	EXIT_SAFE_BLOCK;
+	bench_escape(roots);
+}
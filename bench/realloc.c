@@ -0,0 +1,58 @@
+#include "bench.h"
+#include "safe_blocks.h"
+
+/*
+ * realloc growth outside and inside a safe block: a buffer growing by small
+ * steps, as a string builder does, and one doubling into the large object
+ * space. The contents are touched after every call.
+ */
+
+#define STEP 16
+#define STEP_MAX (1024 * 1024)
+#define DOUBLE_MAX (64 * 1024 * 1024)
+#define ROUNDS 8
+
+static void bench_steps(const char *name)
+{
+	uint64_t ns = 0, ops = 0;
+	for (size_t round = 0; round < ROUNDS; round++) {
+		uint64_t start = bench_now();
+		char *buf = NULL;
+		for (size_t size = STEP; size <= STEP_MAX; size += STEP) {
+			buf = realloc(buf, size);
+			buf[size - 1] = 'A';
+			ops++;
+		}
+		free(buf);
+		ns += bench_now() - start;
+	}
+	bench_report(name, STEP, ops, ns, 0);
+}
+
+static void bench_doubling(const char *name)
+{
+	uint64_t ns = 0, ops = 0;
+	for (size_t round = 0; round < ROUNDS; round++) {
+		uint64_t start = bench_now();
+		char *buf = NULL;
+		for (size_t size = STEP; size <= DOUBLE_MAX; size *= 2) {
+			buf = realloc(buf, size);
+			buf[size - 1] = 'A';
+			ops++;
+		}
+		free(buf);
+		ns += bench_now() - start;
+	}
+	bench_report(name, DOUBLE_MAX, ops, ns, 0);
+}
+
+int main()
+{
+	bench_steps("realloc_step_unsafe");
+	bench_doubling("realloc_double_unsafe");
+
+	ENTER_SAFE_BLOCK;
+	bench_steps("realloc_step_safe");
+	bench_doubling("realloc_double_safe");
+	EXIT_SAFE_BLOCK;
+}
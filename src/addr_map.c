@@ -0,0 +1,133 @@
+#include "addr_map.h"
+#include <string.h>
+
+static inline size_t addr_map_hash(struct addr_map_s *m, uintptr_t key)
+{
+	/* allocations are at least 8 byte aligned, drop the zero bits
+	 * before mixing (fibonacci hashing) */
+	return ((key >> 3) * 0x9e3779b97f4a7c15UL) & (m->cap - 1);
+}
+
+static int addr_map_alloc(mi_heap_t *heap, struct addr_map_s *m, size_t cap)
+{
+	m->keys = mi_heap_calloc(heap, cap, sizeof(uintptr_t));
+	m->vals = mi_heap_malloc(heap, cap * sizeof(uint32_t));
+	if (m->keys == NULL || m->vals == NULL) {
+		mi_free(m->keys);
+		mi_free(m->vals);
+		return EXIT_FAILURE;
+	}
+	m->cap = cap;
+	m->cnt = 0;
+	return EXIT_SUCCESS;
+}
+
+int addr_map_init(mi_heap_t *heap, struct addr_map_s *m)
+{
+	if (addr_map_alloc(heap, m, ADDR_MAP_INIT_CAP)) {
+		perror("addr_map_init: mi_heap_malloc");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+void addr_map_fini(struct addr_map_s *m)
+{
+	mi_free(m->keys);
+	mi_free(m->vals);
+	m->keys = NULL;
+	m->vals = NULL;
+	m->cap = m->cnt = 0;
+}
+
+void addr_map_clear(struct addr_map_s *m)
+{
+	memset(m->keys, 0, m->cap * sizeof(uintptr_t));
+	m->cnt = 0;
+}
+
+static void addr_map_insert(struct addr_map_s *m, uintptr_t key, uint32_t val)
+{
+	size_t i = addr_map_hash(m, key);
+	while (m->keys[i] != 0 && m->keys[i] != key) {
+		i = (i + 1) & (m->cap - 1);
+	}
+	if (m->keys[i] == 0) {
+		m->cnt++;
+	}
+	m->keys[i] = key;
+	m->vals[i] = val;
+}
+
+static int addr_map_grow(mi_heap_t *heap, struct addr_map_s *m)
+{
+	struct addr_map_s old = *m;
+	if (addr_map_alloc(heap, m, old.cap * 2)) {
+		*m = old;
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < old.cap; i++) {
+		if (old.keys[i] != 0) {
+			addr_map_insert(m, old.keys[i], old.vals[i]);
+		}
+	}
+	addr_map_fini(&old);
+	return EXIT_SUCCESS;
+}
+
+int addr_map_put(mi_heap_t *heap, struct addr_map_s *m, uintptr_t key,
+		 uint32_t val)
+{
+	/* keep load factor below 1/2, probes stay short */
+	if (2 * (m->cnt + 1) > m->cap && addr_map_grow(heap, m)) {
+		perror("addr_map_put: mi_heap_malloc");
+		return EXIT_FAILURE;
+	}
+	addr_map_insert(m, key, val);
+	return EXIT_SUCCESS;
+}
+
+bool addr_map_get(struct addr_map_s *m, uintptr_t key, uint32_t *val)
+{
+	size_t i = addr_map_hash(m, key);
+	while (m->keys[i] != 0) {
+		if (m->keys[i] == key) {
+			*val = m->vals[i];
+			return true;
+		}
+		i = (i + 1) & (m->cap - 1);
+	}
+	return false;
+}
+
+/* only removes key if it still maps to val */
+bool addr_map_del(struct addr_map_s *m, uintptr_t key, uint32_t val)
+{
+	size_t mask = m->cap - 1;
+	size_t i = addr_map_hash(m, key);
+	while (m->keys[i] != key) {
+		if (m->keys[i] == 0) {
+			return false;
+		}
+		i = (i + 1) & mask;
+	}
+	if (m->vals[i] != val) {
+		return false;
+	}
+
+	/* backward shift: pull later entries of the probe sequence into the
+	 * hole as long as that doesn't move them before their home bucket */
+	size_t hole = i;
+	for (size_t j = (i + 1) & mask; m->keys[j] != 0; j = (j + 1) & mask) {
+		size_t home = addr_map_hash(m, m->keys[j]);
+		if (((j - home) & mask) < ((j - hole) & mask)) {
+			continue;
+		}
+		m->keys[hole] = m->keys[j];
+		m->vals[hole] = m->vals[j];
+		hole = j;
+	}
+	m->keys[hole] = 0;
+	m->cnt--;
+	return true;
+}
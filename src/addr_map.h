@@ -0,0 +1,30 @@
+#ifndef ADDR_MAP_H
+#define ADDR_MAP_H
+
+#include <mimalloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* OPEN ADDRESSING (LINEAR PROBING) MAP FROM ADDRESS TO BOOK SLOT. KEY 0 MARKS
+ * AN EMPTY BUCKET, DELETION SHIFTS ENTRIES BACK SO THERE ARE NO TOMBSTONES */
+
+#define ADDR_MAP_INIT_CAP 2048 /* must be a power of 2 */
+
+struct addr_map_s {
+	uintptr_t *keys;
+	uint32_t *vals;
+	size_t cap;
+	size_t cnt;
+};
+
+int addr_map_init(mi_heap_t *heap, struct addr_map_s *m);
+int addr_map_put(mi_heap_t *heap, struct addr_map_s *m, uintptr_t key,
+		 uint32_t val);
+bool addr_map_get(struct addr_map_s *m, uintptr_t key, uint32_t *val);
+bool addr_map_del(struct addr_map_s *m, uintptr_t key, uint32_t val);
+void addr_map_clear(struct addr_map_s *m);
+void addr_map_fini(struct addr_map_s *m);
+
+#endif
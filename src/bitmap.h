@@ -0,0 +1,29 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* DENSE BITMAPS OF 64-BIT WORDS, CALLER OWNS THE MEMORY */
+
+#define BITMAP_WORD_BITS 64
+#define BITMAP_WORDS(n) (((n) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+#define BITMAP_BYTES(n) (BITMAP_WORDS(n) * sizeof(uint64_t))
+
+static inline bool bitmap_test(const uint64_t *bm, size_t i)
+{
+	return (bm[i / BITMAP_WORD_BITS] >> (i % BITMAP_WORD_BITS)) & 1;
+}
+
+static inline void bitmap_set(uint64_t *bm, size_t i)
+{
+	bm[i / BITMAP_WORD_BITS] |= 1UL << (i % BITMAP_WORD_BITS);
+}
+
+static inline void bitmap_clear(uint64_t *bm, size_t i)
+{
+	bm[i / BITMAP_WORD_BITS] &= ~(1UL << (i % BITMAP_WORD_BITS));
+}
+
+#endif
@@ -0,0 +1,178 @@
+#include "blacklist.h"
+#include "bitmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t blacklist_cnt = 0;
+
+static uintptr_t base_addr;
+static size_t page_cnt;
+static uint64_t *seen; /* hit during the cycle in progress */
+static uint64_t *prev; /* hit during the last finished one */
+static uint64_t *listed; /* seen | prev as of the last publish */
+static uint64_t generation = 0;
+
+/* words [lo, hi) of a bitmap that may be set, so that a publish only
+ * walks the part of a large heap false pointers went to */
+struct span_s {
+	size_t lo;
+	size_t hi;
+};
+#define SPAN_EMPTY ((struct span_s){.lo = SIZE_MAX, .hi = 0})
+static struct span_s seen_span = SPAN_EMPTY;
+static struct span_s prev_span = SPAN_EMPTY;
+static struct span_s listed_span = SPAN_EMPTY;
+
+static struct span_s span_union(struct span_s a, struct span_s b)
+{
+	return (struct span_s){.lo = a.lo < b.lo ? a.lo : b.lo,
+			       .hi = a.hi > b.hi ? a.hi : b.hi};
+}
+
+/* thread safe, parallel markers may widen seen_span at once */
+static void span_widen(struct span_s *span, size_t w)
+{
+	size_t lo = __atomic_load_n(&span->lo, __ATOMIC_RELAXED);
+	while (w < lo && !__atomic_compare_exchange_n(&span->lo, &lo, w, true,
+						      __ATOMIC_RELAXED,
+						      __ATOMIC_RELAXED)) {
+	}
+	size_t hi = __atomic_load_n(&span->hi, __ATOMIC_RELAXED);
+	while (w + 1 > hi &&
+	       !__atomic_compare_exchange_n(&span->hi, &hi, w + 1, true,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED)) {
+	}
+}
+
+/* one bit per page of [base, base + size), the bitmaps live in heap */
+int blacklist_init(mi_heap_t *heap, void *base, size_t size)
+{
+	base_addr = (uintptr_t)base;
+	page_cnt = (size >> BLACKLIST_PAGE_SHIFT) + 1;
+	seen = mi_heap_calloc(heap, BITMAP_WORDS(page_cnt), sizeof(uint64_t));
+	prev = mi_heap_calloc(heap, BITMAP_WORDS(page_cnt), sizeof(uint64_t));
+	listed =
+	    mi_heap_calloc(heap, BITMAP_WORDS(page_cnt), sizeof(uint64_t));
+	if (seen == NULL || prev == NULL || listed == NULL) {
+		perror("blacklist_init: mi_heap_calloc");
+		blacklist_fini();
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+void blacklist_fini(void)
+{
+	__atomic_store_n(&blacklist_cnt, 0, __ATOMIC_RELAXED);
+	mi_free(seen);
+	mi_free(prev);
+	mi_free(listed);
+	seen = prev = listed = NULL;
+}
+
+/* addr is in the heap range but no object holds it. Called by parallel
+ * markers too, a page hit again is usually already set */
+void blacklist_add(uintptr_t addr)
+{
+	if (seen == NULL) {
+		return;
+	}
+	size_t page = (addr - base_addr) >> BLACKLIST_PAGE_SHIFT;
+	uint64_t bit = 1UL << (page % BITMAP_WORD_BITS);
+	uint64_t *word = &seen[page / BITMAP_WORD_BITS];
+	if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) == 0) {
+		__atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+		span_widen(&seen_span, page / BITMAP_WORD_BITS);
+	}
+}
+
+/* a cycle finished, what it saw replaces what the one before it saw */
+void blacklist_publish(void)
+{
+	if (seen == NULL) {
+		return;
+	}
+	/* words listed before may have to be cleared */
+	struct span_s next = span_union(seen_span, prev_span);
+	struct span_s walk = span_union(next, listed_span);
+	size_t cnt = 0;
+	for (size_t i = walk.lo; i < walk.hi; i++) {
+		uint64_t word = seen[i] | prev[i];
+		__atomic_store_n(&listed[i], word, __ATOMIC_RELAXED);
+		cnt += __builtin_popcountl(word);
+	}
+	listed_span = next;
+
+	uint64_t *tmp = prev;
+	prev = seen;
+	seen = tmp;
+	if (prev_span.lo < prev_span.hi) {
+		memset(seen + prev_span.lo, 0,
+		       (prev_span.hi - prev_span.lo) * sizeof(uint64_t));
+	}
+	prev_span = seen_span;
+	seen_span = SPAN_EMPTY;
+	__atomic_store_n(&blacklist_cnt, cnt, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&generation, 1, __ATOMIC_RELAXED);
+}
+
+/* the size of what blacklist_export writes, in words */
+size_t blacklist_words(void)
+{
+	return seen == NULL ? 0 : BITMAP_WORDS(page_cnt);
+}
+
+/* what the cycle in progress saw so far, for a marking child to hand
+ * back to its parent */
+void blacklist_export(uint64_t *bits)
+{
+	if (seen != NULL) {
+		memcpy(bits, seen, BITMAP_BYTES(page_cnt));
+	}
+}
+
+void blacklist_import(const uint64_t *bits)
+{
+	if (seen == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < BITMAP_WORDS(page_cnt); i++) {
+		if (bits[i] != 0) {
+			seen[i] |= bits[i];
+			span_widen(&seen_span, i);
+		}
+	}
+}
+
+/* bumped by every publish, holders of a hint know when to look again */
+uint64_t blacklist_generation(void)
+{
+	return __atomic_load_n(&generation, __ATOMIC_RELAXED);
+}
+
+bool blacklist_range(uintptr_t addr, size_t size)
+{
+	if (listed == NULL || addr < base_addr || size == 0) {
+		return false;
+	}
+	size_t first = (addr - base_addr) >> BLACKLIST_PAGE_SHIFT;
+	size_t last = (addr - base_addr + size - 1) >> BLACKLIST_PAGE_SHIFT;
+	if (last >= page_cnt) {
+		last = page_cnt - 1;
+	}
+	for (size_t p = first; p <= last; p++) {
+		uint64_t word = __atomic_load_n(&listed[p / BITMAP_WORD_BITS],
+						__ATOMIC_RELAXED);
+		if (word == 0) {
+			/* skip the rest of an empty word */
+			p |= BITMAP_WORD_BITS - 1;
+			continue;
+		}
+		if ((word >> (p % BITMAP_WORD_BITS)) & 1) {
+			return true;
+		}
+	}
+	return false;
+}
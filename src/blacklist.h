@@ -0,0 +1,42 @@
+#ifndef BLACKLIST_H
+#define BLACKLIST_H
+#define _GNU_SOURCE
+
+/*
+ * PAGES OF THE SAFE HEAP MAPPING THAT FALSE POINTERS HIT. A SCANNED WORD IN
+ * THE HEAP RANGE THAT RESOLVES TO NO OBJECT WOULD PIN WHATEVER GETS
+ * ALLOCATED THERE NEXT, SO ITS PAGE IS RECORDED WHILE MARKING AND NEW
+ * BLOCKS ARE KEPT OFF IT. A PAGE STAYS LISTED FOR AS LONG AS ONE OF THE
+ * LAST TWO CYCLES SAW SUCH A WORD. blacklist_add IS THREAD SAFE, THE OTHERS
+ * ARE CALLED UNDER THE RUNTIME'S LOCK, READERS ONLY GET A HINT.
+ */
+
+#include <mimalloc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLACKLIST_PAGE_SHIFT 12
+#define BLACKLIST_PAGE_SIZE (1UL << BLACKLIST_PAGE_SHIFT)
+
+/* pages listed by the last publish, 0 when off */
+extern size_t blacklist_cnt;
+
+int blacklist_init(mi_heap_t *heap, void *base, size_t size);
+void blacklist_fini(void);
+void blacklist_add(uintptr_t addr);
+void blacklist_publish(void);
+size_t blacklist_words(void);
+void blacklist_export(uint64_t *bits);
+void blacklist_import(const uint64_t *bits);
+uint64_t blacklist_generation(void);
+bool blacklist_range(uintptr_t addr, size_t size);
+
+/* whether [addr, addr + size) touches a listed page */
+static inline bool blacklist_hit(const void *addr, size_t size)
+{
+	return __atomic_load_n(&blacklist_cnt, __ATOMIC_RELAXED) != 0 &&
+	       blacklist_range((uintptr_t)addr, size);
+}
+
+#endif
@@ -1,152 +1,745 @@
 #include "bookkeeper.h"
-#define INIT_LENGTH 1024
-#define MSG_LEN 64
+#include "addr_map.h"
+#include "bitmap.h"
+#include "blacklist.h"
+#include "deque.h"
+#include "dirty.h"
+#include "large.h"
+#include "pool.h"
+#include "probes.h"
+#include "scan.h"
+#include "stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
-static struct alloc_data_s *book;
+/*
+ * the book, one column per field so that each loop only pulls in what it
+ * reads. Indexed by slot, sized to book_len.
+ * book_off: (addr - heap_addr) in BOOK_GRANULE units
+ * book_size: usable bytes of a mimalloc block. Large blocks keep theirs in
+ *            large.c, see entry_size
+ * book_next: page index chain, or the free slot chain for empty slots
+ * book_age: collections an object requested free has stayed unreachable
+ */
+static uint32_t *book_off;
+static uint32_t *book_size;
+static uint32_t *book_next;
+static uint8_t *book_age;
 static uint32_t book_cnt = 0;
-static uint32_t book_len = INIT_LENGTH;
+static uint32_t book_len;
+/* empty slots (+ 1) chained through book_next, 0 if none */
+static uint32_t free_slots = 0;
+
+/* side bitmaps indexed by book slot, sized to book_len. Marks are cleared
+ * with a single memset at the start of each cycle */
+static uint64_t *mark_bits;
+static uint64_t *live_bits;
+static uint64_t *free_bits; /* free was requested */
+static uint64_t *noscan_bits; /* holds no pointers, never scanned */
+
+/* exact object addr -> book slot, for free requests */
+static struct addr_map_s book_map;
 
-static mi_heap_t *heap; /* heap used for explicit allocations */
+/* heap used for explicit allocations. Every thread calling in (under the
+ * runtime's lock) uses its own, mimalloc heaps are not shared */
+static __thread mi_heap_t *heap;
 
 static uintptr_t heap_addr; /* used for simple ptrs bounds checking */
 static size_t heap_size;
 
+/*
+ * page index over the safe heap, used to resolve (interior) ptrs without
+ * walking the whole book. Slots are stored + 1 so that 0 means empty.
+ * page_head: chain (through book_next) of objects starting in page
+ * page_spill: the single object starting in an earlier page that reaches
+ * into this one (objects never overlap, so there can only be one)
+ */
+static uint32_t *page_head;
+static uint32_t *page_spill;
+static size_t page_cnt;
+static size_t page_hi; /* pages past this one never held an object */
+static_assert(BOOK_PAGE_SHIFT == DIRTY_PAGE_SHIFT,
+	      "dirty rescans walk the page index one OS page at a time");
+
+static struct gc_config_s config;
+
+/* free requests since the last collection, resolved when it starts */
+static struct stack_s pending;
+static size_t pending_bytes = 0;
+static size_t live_bytes = 0;
+static size_t high_water;
+/* soft limit on live_bytes, doubles up to heap_size when a full collection
+ * can't get under it */
+static size_t heap_limit;
+
+/* lazy sweep, the bitmap words [sweep_cursor, sweep_end) of the last cycle
+ * are still to be swept. Their mark bits stay valid until then */
+static bool sweeping = false;
+static uint64_t sweep_frees; /* actual_frees_cnt when the sweep started */
+static size_t sweep_cursor;
+static size_t sweep_end;
+/* finished sweeps and purges, tells the threads when to trim their heaps */
+static uint64_t reclaims = 0;
+
+enum mark_phase_e {
+	MARK_IDLE,  /* no cycle in progress */
+	MARK_ROOTS, /* scanning the global data segments */
+	MARK_HEAP,  /* draining the worklist */
+};
+
+/* root ranges a cycle scans. Either the arrays of cycle.roots or, with
+ * dirty_roots, the root pages that were written or hold heap words */
+struct root_ranges_s {
+	uintptr_t **start;
+	uintptr_t **end;
+	size_t cnt;
+	size_t len;
+};
+
+/* everything needed to resume a cycle across calls when incremental */
+static struct mark_state_s {
+	enum mark_phase_e phase;
+	struct stack_s worklist;
+	struct root_ranges_s roots;
+	struct root_ranges_s scan; /* the part of roots this cycle scans */
+	size_t root; /* next scan range */
+	/* region being scanned, [cursor, end) */
+	uintptr_t *cursor;
+	uintptr_t *end;
+} cycle;
+
+/* loader generation the cached cycle.roots was built at */
+static struct {
+	unsigned long long adds;
+	unsigned long long subs;
+	bool valid;
+} roots_gen;
+static uintptr_t page_size;
+
+/* dirty_roots: one bit per page of cycle.roots, set if the page held a word
+ * in the heap range when it was last read. Clean pages keep their bit */
+static uint64_t *root_hot;
+static size_t root_hot_len; /* in pages */
+static bool root_hot_valid;
+
+/* parallel marking, one worker per pool thread (caller included) */
+#define DEQUE_CAP (1UL << 16)
+#define ROOT_CHUNK_WORDS (1UL << 14) /* roots are handed out in pieces */
+#define SPLIT_WORDS (1UL << 14) /* bigger objects are scanned in pieces */
+#define STEAL_TRIES 4
+
+struct mark_worker_s {
+	struct deque_s deque;
+	struct stack_s overflow; /* surplus when the deque is full */
+	mi_heap_t *heap;	 /* heap of the thread running the worker */
+	uint32_t seed;		 /* picks steal victims */
+};
+
+struct root_chunk_s {
+	uintptr_t *start;
+	uintptr_t *end;
+};
+
+static struct par_state_s {
+	struct mark_worker_s *workers;
+	unsigned cnt;
+	struct root_chunk_s *chunks;
+	size_t chunks_cnt;
+	size_t chunks_len;
+	_Atomic size_t next_chunk;
+	_Atomic unsigned idle;
+	_Atomic bool failed;
+} par;
+
+/*
+ * fork mode: a child marks a copy-on-write snapshot taken with the world
+ * stopped. An object unreachable in the snapshot stays unreachable, so the
+ * requested frees it finds garbage can be swept once it is done, while the
+ * process goes on. Objects allocated or requested free since are kept.
+ */
+struct snapshot_res_s {
+	uint64_t done; /* set by the child once garbage is complete */
+	/* requested free and unmarked, per book slot. Followed by the pages
+	 * the child blacklisted */
+	uint64_t garbage[];
+};
+
+#ifdef _BOOKKEEPER_DEBUG
+bool dbg_quiet = false;
+#endif
+
+static struct snapshot_s {
+	pid_t pid; /* 0 when no child is marking */
+	struct snapshot_res_s *res; /* shared with the child */
+	size_t res_bytes;
+	size_t words; /* of garbage, book_cnt at the snapshot */
+} snap;
+static void snapshot_cancel(void);
+
+/* a child the program forks must leave its parent's marking child alone */
+static void snapshot_atfork_child(void)
+{
+	snap.pid = 0;
+}
+
 static uint64_t free_requests_cnt = 0;
 static uint64_t actual_frees_cnt = 0;
+static uint64_t collections_cnt = 0;
+static uint64_t full_collections_cnt = 0;
+static size_t live_objects = 0;
+/* time spent per phase, for the stats page */
+static uint64_t roots_ns = 0;
+static uint64_t mark_ns = 0;
+static uint64_t sweep_ns = 0;
 
-int bookkeeper_init(mi_heap_t *_heap, void *_heap_addr, size_t _heap_size)
+int bookkeeper_init(mi_heap_t *_heap, void *_heap_addr, size_t _heap_size,
+		    const struct gc_config_s *_config)
 {
 	heap_addr = (uintptr_t)_heap_addr;
 	heap_size = _heap_size;
 	heap = _heap;
-	size_t size = sizeof(struct alloc_data_s) * INIT_LENGTH;
-	book = mi_heap_malloc(heap, size);
-	if (book == NULL) {
-		perror("bookkeeper_init: mi_heap_malloc");
+	config = *_config;
+	high_water = config.high_water;
+	heap_limit = config.heap_size < heap_size ? config.heap_size : heap_size;
+	book_len = config.init_length;
+	if (((heap_size - 1) >> BOOK_GRANULE_SHIFT) > UINT32_MAX) {
+		fprintf(stderr, "bookkeeper_init: heap too large for 32-bit "
+				"book offsets\n");
 		return EXIT_FAILURE;
 	}
+	book_off = mi_heap_malloc(heap, book_len * sizeof(uint32_t));
+	book_size = mi_heap_malloc(heap, book_len * sizeof(uint32_t));
+	book_next = mi_heap_malloc(heap, book_len * sizeof(uint32_t));
+	book_age = mi_heap_malloc(heap, book_len * sizeof(uint8_t));
+	if (book_off == NULL || book_size == NULL || book_next == NULL ||
+	    book_age == NULL) {
+		perror("bookkeeper_init: mi_heap_malloc");
+		goto cleanup;
+	}
+
+	/* + 1 so that off by one ptrs at the end of the heap have a page */
+	page_cnt = (heap_size >> BOOK_PAGE_SHIFT) + 1;
+	page_head = mi_heap_calloc(heap, page_cnt, sizeof(uint32_t));
+	page_spill = mi_heap_calloc(heap, page_cnt, sizeof(uint32_t));
+	if (page_head == NULL || page_spill == NULL) {
+		perror("bookkeeper_init: mi_heap_calloc");
+		goto cleanup;
+	}
+
+	mark_bits = mi_heap_calloc(heap, BITMAP_WORDS(book_len),
+				   sizeof(uint64_t));
+	live_bits = mi_heap_calloc(heap, BITMAP_WORDS(book_len),
+				   sizeof(uint64_t));
+	free_bits = mi_heap_calloc(heap, BITMAP_WORDS(book_len),
+				   sizeof(uint64_t));
+	noscan_bits = mi_heap_calloc(heap, BITMAP_WORDS(book_len),
+				     sizeof(uint64_t));
+	if (mark_bits == NULL || live_bits == NULL || free_bits == NULL ||
+	    noscan_bits == NULL) {
+		perror("bookkeeper_init: mi_heap_calloc");
+		goto cleanup;
+	}
+
+	/* reserved up front, the first collection may run with a full heap */
+	cycle.roots.start = mi_heap_malloc(heap, MAX_SEGMENTS *
+						       sizeof(uintptr_t *));
+	cycle.roots.end = mi_heap_malloc(heap, MAX_SEGMENTS *
+						     sizeof(uintptr_t *));
+	if (cycle.roots.start == NULL || cycle.roots.end == NULL) {
+		perror("bookkeeper_init: mi_heap_malloc");
+		goto cleanup;
+	}
+	cycle.roots.len = MAX_SEGMENTS;
+
+	if (addr_map_init(heap, &book_map)) {
+		goto cleanup;
+	}
+
+	if (stack_init(heap, &pending)) {
+		addr_map_fini(&book_map);
+		goto cleanup;
+	}
+	if (stack_init(heap, &cycle.worklist)) {
+		stack_fini(&pending);
+		addr_map_fini(&book_map);
+		goto cleanup;
+	}
+
+	if ((config.incremental || config.dirty_roots) && dirty_init()) {
+		fprintf(stderr, "WARNING: bookkeeper_init: soft-dirty bits "
+				"unavailable, incremental cycles will rescan "
+				"the whole heap before sweeping and every root "
+				"page is scanned\n");
+		config.dirty_roots = false;
+	}
+
+	if (config.fork_mark) {
+		pthread_atfork(NULL, NULL, snapshot_atfork_child);
+	}
+
+	page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+	scan_init();
+	DBG_PRNT("scan kernel: %s\n", scan_kernel());
 
 	return EXIT_SUCCESS;
+
+cleanup:
+	mi_free(mark_bits);
+	mi_free(live_bits);
+	mi_free(free_bits);
+	mi_free(noscan_bits);
+	mi_free(page_head);
+	mi_free(page_spill);
+	mi_free(book_off);
+	mi_free(book_size);
+	mi_free(book_next);
+	mi_free(book_age);
+	mi_free(cycle.roots.start);
+	mi_free(cycle.roots.end);
+	cycle.roots = (struct root_ranges_s){0};
+	return EXIT_FAILURE;
 }
 
 int bookkeeper_exit(void)
 {
-	mi_free(book);
-	book = NULL;
+	snapshot_cancel();
+	dirty_fini();
+	stack_fini(&cycle.worklist);
+	stack_fini(&pending);
+	addr_map_fini(&book_map);
+	mi_free(mark_bits);
+	mi_free(live_bits);
+	mi_free(free_bits);
+	mi_free(noscan_bits);
+	mark_bits = live_bits = free_bits = noscan_bits = NULL;
+	mi_free(page_head);
+	mi_free(page_spill);
+	page_head = page_spill = NULL;
+	mi_free(book_off);
+	mi_free(book_size);
+	mi_free(book_next);
+	mi_free(book_age);
+	book_off = book_size = book_next = NULL;
+	book_age = NULL;
+	if (cycle.scan.start != cycle.roots.start) {
+		mi_free(cycle.scan.start);
+		mi_free(cycle.scan.end);
+	}
+	cycle.scan = (struct root_ranges_s){0};
+	mi_free(cycle.roots.start);
+	mi_free(cycle.roots.end);
+	cycle.roots = (struct root_ranges_s){0};
+	roots_gen.valid = false;
+	mi_free(root_hot);
+	root_hot = NULL;
+	root_hot_len = 0;
 
 	return EXIT_SUCCESS;
 }
 
-int bookkeeper_add(void *addr, size_t size)
+static inline size_t addr_to_page(uintptr_t addr)
 {
-	if (book_cnt == book_len) {
-		// look for empty slot
-		for (size_t i = 0; i < book_len; i++) {
-			if (book[i].addr != 0) {
-				continue;
-			}
-			/* book_cnt should NOT be incremented since we're not
-			 * extending the cnt of the book */
-			book[i].addr = (uintptr_t)addr;
-			book[i].size = size;
-			book[i].requested_free = false;
-			book[i].unreachable_cnt = 0;
-			return EXIT_SUCCESS;
+	return (addr - heap_addr) >> BOOK_PAGE_SHIFT;
+}
+
+static inline uintptr_t book_addr(size_t idx)
+{
+	return heap_addr + ((uintptr_t)book_off[idx] << BOOK_GRANULE_SHIFT);
+}
+
+static inline size_t entry_size(size_t idx)
+{
+	uintptr_t addr = book_addr(idx);
+	if (large_owns((void *)addr)) {
+		return large_usable_size((void *)addr);
+	}
+	return book_size[idx];
+}
+
+static void page_index_insert(size_t idx)
+{
+	uintptr_t obj_addr = book_addr(idx);
+	size_t first = addr_to_page(obj_addr);
+	/* capture off by one ptrs, same as the mark phase */
+	size_t last = addr_to_page(obj_addr + entry_size(idx));
+
+	book_next[idx] = page_head[first];
+	page_head[first] = idx + 1;
+	for (size_t page = first + 1; page <= last; page++) {
+		page_spill[page] = idx + 1;
+	}
+	if (last >= page_hi) {
+		page_hi = last + 1;
+	}
+}
+
+static void page_index_remove(size_t idx)
+{
+	uintptr_t obj_addr = book_addr(idx);
+	size_t first = addr_to_page(obj_addr);
+	size_t last = addr_to_page(obj_addr + entry_size(idx));
+
+	uint32_t *link = &page_head[first];
+	while (*link != 0 && *link != idx + 1) {
+		link = &book_next[*link - 1];
+	}
+	if (*link != 0) {
+		*link = book_next[idx];
+	}
+	book_next[idx] = 0;
+
+	for (size_t page = first + 1; page <= last; page++) {
+		/* stale entries may overlap, only clear what we own */
+		if (page_spill[page] == idx + 1) {
+			page_spill[page] = 0;
 		}
-		// realloc ...
-		size_t elem_size = sizeof(struct alloc_data_s);
-		size_t newsize = elem_size * book_len * 2;
-		void *tmp = mi_heap_realloc(heap, book, newsize);
-		if (tmp == NULL) {
-			perror("bookkeeper_add: mi_heap_realloc");
-			return EXIT_FAILURE;
+	}
+}
+
+static int column_grow(void **col, size_t elem_size, size_t new_len)
+{
+	void *tmp = mi_heap_realloc(heap, *col, elem_size * new_len);
+	if (tmp == NULL) {
+		return EXIT_FAILURE;
+	}
+	*col = tmp;
+	return EXIT_SUCCESS;
+}
+
+static int bitmap_grow(uint64_t **bm, size_t old_len, size_t new_len)
+{
+	size_t old_bytes = BITMAP_BYTES(old_len);
+	size_t new_bytes = BITMAP_BYTES(new_len);
+	uint64_t *tmp = mi_heap_realloc(heap, *bm, new_bytes);
+	if (tmp == NULL) {
+		return EXIT_FAILURE;
+	}
+	memset((char *)tmp + old_bytes, 0, new_bytes - old_bytes);
+	*bm = tmp;
+	return EXIT_SUCCESS;
+}
+
+/* callers may use all of a block (malloc_usable_size), so all of it is
+ * booked and scanned. A huge mimalloc block may round up past the book */
+static size_t block_size(void *addr, size_t size)
+{
+	if (large_owns(addr)) {
+		return large_usable_size(addr);
+	}
+	size_t usable = mi_usable_size(addr);
+	if (usable > BOOK_MAX_SIZE) {
+		usable = BOOK_MAX_SIZE;
+	}
+	return usable > size ? usable : size;
+}
+
+int bookkeeper_add(void *addr, size_t size, bool noscan)
+{
+	if (addr == NULL) {
+		/* failed allocation, nothing to keep track of */
+		return EXIT_SUCCESS;
+	}
+	uintptr_t off = (uintptr_t)addr - heap_addr;
+	if (off >= heap_size || (off & (BOOK_GRANULE - 1)) != 0) {
+		fprintf(stderr, "bookkeeper_add: %p is not a safe heap block\n",
+			addr);
+		return EXIT_FAILURE;
+	}
+	if (size > BOOK_MAX_SIZE && !large_owns(addr)) {
+		fprintf(stderr, "bookkeeper_add: %zu bytes don't fit the book\n",
+			size);
+		return EXIT_FAILURE;
+	}
+	size = block_size(addr, size);
+
+	size_t idx;
+	if (free_slots != 0) {
+		/* reuse empty slot, book_cnt should NOT be incremented since
+		 * we're not extending the cnt of the book */
+		idx = free_slots - 1;
+		free_slots = book_next[idx];
+	} else {
+		if (book_cnt == book_len) {
+			// realloc ...
+			size_t len = book_len * 2;
+			if (column_grow((void **)&book_off, sizeof(uint32_t),
+					len) ||
+			    column_grow((void **)&book_size, sizeof(uint32_t),
+					len) ||
+			    column_grow((void **)&book_next, sizeof(uint32_t),
+					len) ||
+			    column_grow((void **)&book_age, sizeof(uint8_t),
+					len) ||
+			    bitmap_grow(&mark_bits, book_len, len) ||
+			    bitmap_grow(&live_bits, book_len, len) ||
+			    bitmap_grow(&free_bits, book_len, len) ||
+			    bitmap_grow(&noscan_bits, book_len, len)) {
+				perror("bookkeeper_add: mi_heap_realloc");
+				return EXIT_FAILURE;
+			}
+			book_len = len;
 		}
-		book = tmp;
-		book_len *= 2;
+		idx = book_cnt++;
+	}
+
+	if (addr_map_put(heap, &book_map, (uintptr_t)addr, idx)) {
+		book_next[idx] = free_slots;
+		free_slots = idx + 1;
+		return EXIT_FAILURE;
+	}
+	book_off[idx] = off >> BOOK_GRANULE_SHIFT;
+	book_size[idx] = large_owns(addr) ? 0 : size;
+	book_age[idx] = 0;
+	bitmap_clear(free_bits, idx);
+	bitmap_set(live_bits, idx);
+	if (noscan) {
+		bitmap_set(noscan_bits, idx);
+	} else {
+		bitmap_clear(noscan_bits, idx);
 	}
-	size_t idx = book_cnt++;
-	book[idx].addr = (uintptr_t)addr;
-	book[idx].size = size;
-	book[idx].requested_free = false;
-	book[idx].unreachable_cnt = 0;
+	if (cycle.phase != MARK_IDLE || sweeping) {
+		/* allocate black, objects born during a cycle are not
+		 * candidates and their contents are covered by the dirty
+		 * rescan. Same for the ones born before the sweep is over,
+		 * they may reuse a slot it has yet to visit */
+		bitmap_set(mark_bits, idx);
+	}
+	page_index_insert(idx);
+	live_bytes += size;
+	live_objects++;
 	return EXIT_SUCCESS;
 }
 
-int book_del_entry(void *alloc_addr)
+/* the booked size and noscan bit of the block at addr, false if addr isn't
+ * in the book */
+bool bookkeeper_lookup(void *addr, size_t *size, bool *noscan)
 {
-	for (size_t i = 0; i < book_len; i++) {
-		if (UNTAG(book[i].addr) != (uintptr_t)alloc_addr) {
-			continue;
+	uint32_t idx;
+	if (!addr_map_get(&book_map, (uintptr_t)addr, &idx)) {
+		return false;
+	}
+	*size = entry_size(idx);
+	*noscan = bitmap_test(noscan_bits, idx);
+	return true;
+}
+
+/* caller is standing on the slot, no need to look it up */
+/* blocks come from mimalloc or from the large object space */
+static void block_free(void *ptr)
+{
+	if (large_owns(ptr)) {
+		large_free(ptr);
+	} else {
+		mi_free(ptr);
+	}
+}
+
+static void book_del_entry(size_t idx)
+{
+	uintptr_t obj_addr = book_addr(idx);
+	addr_map_del(&book_map, obj_addr, idx);
+	page_index_remove(idx);
+	bitmap_clear(live_bits, idx);
+	live_bytes -= entry_size(idx);
+	live_objects--;
+	book_next[idx] = free_slots;
+	free_slots = idx + 1;
+}
+
+static int par_push(struct mark_worker_s *w, uint64_t item)
+{
+	if (deque_push(&w->deque, item)) {
+		return EXIT_SUCCESS;
+	}
+	return stack_push(w->heap, &w->overflow, (void *)item);
+}
+
+/* capture off by one ptrs */
+static bool entry_holds(size_t i, uintptr_t addr)
+{
+	uintptr_t obj_addr = book_addr(i);
+	return addr >= obj_addr && addr <= obj_addr + entry_size(i);
+}
+
+/* w is NULL when marking sequentially into cycle.worklist */
+static int mark_entry(struct mark_worker_s *w, size_t i)
+{
+	if (w != NULL) {
+		/* only the worker that flips the bit gets to scan it */
+		uint64_t bit = 1UL << (i % BITMAP_WORD_BITS);
+		uint64_t *word = &mark_bits[i / BITMAP_WORD_BITS];
+		if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) {
+			return EXIT_SUCCESS;
+		}
+		if (bitmap_test(noscan_bits, i)) {
+			return EXIT_SUCCESS;
 		}
-		book[i].addr = 0;
+		return par_push(w, i);
+	}
+	if (bitmap_test(mark_bits, i)) {
+		DBG_PRNT("FOUND: %p\n", (void *)book_addr(i));
 		return EXIT_SUCCESS;
 	}
 
-	// addr not found
-	// addr always has 16 bytes size + 2 (for 0x) = 18 bytes
-	static char err_msg[MSG_LEN];
-	snprintf(err_msg, MSG_LEN, "book_del_entry: %p addr not found\n",
-		 alloc_addr);
-	write(STDERR_FILENO, err_msg, strlen(err_msg));
-	return EXIT_FAILURE;
+	/* mark, pointer-free objects are done right away */
+	bitmap_set(mark_bits, i);
+	if (bitmap_test(noscan_bits, i)) {
+		return EXIT_SUCCESS;
+	}
+	return stack_push(heap, &cycle.worklist, (void *)i);
 }
 
-static int mark_from_region(struct stack_s *worklist, uintptr_t *start,
+static int mark_from_region(struct mark_worker_s *w, uintptr_t *start,
 			    uintptr_t *end)
 {
 	DBG_PRNT("REGION: %p - %p\n", start, end);
-	for (uintptr_t *cur = start; cur < end; cur++) {
+	/* most words are not heap addresses, the filter skips them in bulk */
+	for (uintptr_t *cur = scan_next(start, end, heap_addr, heap_size);
+	     cur < end; cur = scan_next(cur + 1, end, heap_addr, heap_size)) {
 		/* mark iff addr belongs to a heap object */
 		uintptr_t addr = *cur;
-		if (addr < heap_addr || addr > heap_addr + heap_size) {
-			continue;
-		}
 
-		for (size_t i = 0; i < book_cnt; i++) {
-			if (book[i].addr == 0) {
-				continue;
-			}
+		/* only the objects starting in, or spilling into, the page of
+		 * addr can contain it. Empty pages are rejected right away */
+		size_t page = addr_to_page(addr);
+		uint32_t spill = page_spill[page];
+		uint32_t slot = page_head[page];
+		bool held = false;
 
-			uintptr_t obj_addr = UNTAG(book[i].addr);
-			/* capture off by one ptrs */
-			if (addr < obj_addr || addr > obj_addr + book[i].size) {
-				continue;
+		if (spill != 0 && entry_holds(spill - 1, addr)) {
+			held = true;
+			if (mark_entry(w, spill - 1)) {
+				return EXIT_FAILURE;
 			}
-			if (IS_MARKED(book[i].addr)) {
-				DBG_PRNT("FOUND: %p -> %p\n", (void *)cur,
-					 (void *)obj_addr);
+		}
+		for (; slot != 0; slot = book_next[slot - 1]) {
+			if (!entry_holds(slot - 1, addr)) {
 				continue;
 			}
-
-			/* mark */
-			book[i].addr |= 0x1;
-			int ret = stack_push(heap, worklist, &book[i]);
-			if (ret) {
+			held = true;
+			if (mark_entry(w, slot - 1)) {
 				return EXIT_FAILURE;
 			}
 		}
+		/* a false pointer, it would pin the next block put there */
+		if (!held) {
+			blacklist_add(addr);
+		}
 	}
 	return EXIT_SUCCESS;
 }
 
-static int mark(struct stack_s *worklist)
+/* bytes of the root ranges this cycle scans, for the gc_roots probe */
+static size_t probe_root_bytes(void)
 {
-	while (!stack_is_empty(worklist)) {
-		struct alloc_data_s *book_entry;
-		stack_pop(worklist, (void **)&book_entry);
-
-		/* convert obj addr and size into region... */
-		uintptr_t obj_addr = UNTAG(book_entry->addr);
-		uintptr_t *start = (uintptr_t *)PTR_ALIGN_UP(obj_addr);
-		uintptr_t *end =
-		    (uintptr_t *)PTR_ALIGN_DOWN(obj_addr + book_entry->size);
+	size_t bytes = 0;
+	for (size_t i = 0; i < cycle.scan.cnt; i++) {
+		bytes += (uintptr_t)cycle.scan.end[i] -
+			 (uintptr_t)cycle.scan.start[i];
+	}
+	return bytes;
+}
 
-		mark_from_region(worklist, start, end);
+/* charges the time since t to the phase the cycle is in */
+static void phase_time(uint64_t *t)
+{
+	uint64_t now = stats_now();
+	if (cycle.phase == MARK_ROOTS) {
+		roots_ns += now - *t;
+	} else {
+		mark_ns += now - *t;
 	}
+	*t = now;
+}
 
+/*
+ * advances the cycle by scanning at most budget words (every object popped
+ * costs at least one). done is set once the roots are scanned and the
+ * worklist is drained.
+ */
+static int mark_step(size_t budget, bool *done)
+{
+	uint64_t t = stats_now();
+	*done = false;
+	while (budget > 0) {
+		if (cycle.cursor == cycle.end) {
+			if (cycle.phase == MARK_ROOTS &&
+			    cycle.root < cycle.scan.cnt) {
+				cycle.cursor = cycle.scan.start[cycle.root];
+				cycle.end = cycle.scan.end[cycle.root];
+				cycle.root++;
+				continue;
+			}
+			if (cycle.phase == MARK_ROOTS) {
+				phase_time(&t);
+				if (PROBE_ENABLED(gc_roots)) {
+					PROBE(gc_roots, t, cycle.scan.cnt,
+					      probe_root_bytes());
+				}
+			}
+			cycle.phase = MARK_HEAP;
+			if (stack_is_empty(&cycle.worklist)) {
+				*done = true;
+				phase_time(&t);
+				return EXIT_SUCCESS;
+			}
+			void *slot;
+			stack_pop(&cycle.worklist, &slot);
+			size_t i = (size_t)slot;
+
+			/* convert obj addr and size into region... */
+			uintptr_t obj_addr = book_addr(i);
+			cycle.cursor = (uintptr_t *)PTR_ALIGN_UP(obj_addr);
+			cycle.end = (uintptr_t *)PTR_ALIGN_DOWN(obj_addr +
+								entry_size(i));
+			budget--;
+			continue;
+		}
+
+		size_t n = cycle.end - cycle.cursor;
+		if (n > budget) {
+			n = budget;
+		}
+		if (mark_from_region(NULL, cycle.cursor,
+				     cycle.cursor + n)) {
+			return EXIT_FAILURE;
+		}
+		cycle.cursor += n;
+		budget -= n;
+	}
+	phase_time(&t);
 	return EXIT_SUCCESS;
 }
 
+static int ranges_push(struct root_ranges_s *r, uintptr_t *start,
+		       uintptr_t *end);
+
+/* appends [start, end) to regions, pointer aligned. empty ranges are dropped.
+ * If the array cannot grow the range is not scanned, which is warned about
+ * once rather than failing the collection */
+static void regions_add(struct root_ranges_s *regions, uintptr_t start,
+			uintptr_t end)
+{
+	static bool warned;
+	uintptr_t *s = PTR_ALIGN_UP((uintptr_t *)start);
+	uintptr_t *e = PTR_ALIGN_DOWN((uintptr_t *)end);
+	if (s >= e) {
+		return;
+	}
+	DBG_PRNT("LOADING REGION: %p - %p\n", s, e);
+	if (ranges_push(regions, s, e) && !warned) {
+		char *err_msg = "WARNING: regions_add: out of memory for root "
+				"regions, some data segments are not scanned\n";
+		write(STDERR_FILENO, err_msg, strlen(err_msg));
+		warned = true;
+	}
+}
+
 static int dynlibs_data_cb(struct dl_phdr_info *info, size_t size, void *data)
 {
 	/* ensures compatibility across systems by making sure
@@ -157,22 +750,31 @@ static int dynlibs_data_cb(struct dl_phdr_info *info, size_t size, void *data)
 		return 1;
 	}
 
-	struct mem_regions_s *data_segments = (struct mem_regions_s *)data;
-	/* skip hook data. should NOT go through my metadata
-	 * (maybe check with etext, end addr to avoid strstr...)
-	 */
-	if (strstr(info->dlpi_name, "libruntime.so")) {
-		return 0;
+	struct root_ranges_s *data_segments = (struct root_ranges_s *)data;
+	uintptr_t self = (uintptr_t)&cycle;
+	uintptr_t relro_start = 0;
+	uintptr_t relro_end = 0;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+		uintptr_t end = start + phdr->p_memsz;
+
+		/* skip hook data. should NOT go through my metadata */
+		if (phdr->p_type == PT_LOAD && self >= start && self < end) {
+			return 0;
+		}
+
+		/* made read only after relocation. the loader rounds both
+		 * ends down, so the tail of the last page stays writable */
+		if (phdr->p_type == PT_GNU_RELRO) {
+			relro_start = __builtin_align_down(start, page_size);
+			relro_end = __builtin_align_down(end, page_size);
+		}
 	}
 	DBG_PRNT("dynlib: %s\n", info->dlpi_name);
 
 	for (int i = 0; i < info->dlpi_phnum; i++) {
 		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
-		/*
-		 * further optimization: find sections in
-		 * GNU_RELRO and remove them from scanning since
-		 * they're going to be made READ ONLY
-		 */
 
 		// data could only be found in a loadable and
 		// writable segment
@@ -180,150 +782,998 @@ static int dynlibs_data_cb(struct dl_phdr_info *info, size_t size, void *data)
 			continue;
 		}
 
-		uint32_t cnt = data_segments->cnt;
-		if (cnt >= data_segments->len) {
-			char *err_msg = "dynlibs_data_cb: "
-					"dynlibs cnt >= MAX\n";
-			write(STDERR_FILENO, err_msg, strlen(err_msg));
-			return 1;
-		}
-
 		/* segment most likely containing .data and/or .bss */
-		void *data_start = (void *)(info->dlpi_addr + phdr->p_vaddr);
-		void *data_end = (void *)(data_start + phdr->p_memsz);
-		DBG_PRNT("LOADING REGION: %p - %p\n", data_start, data_end);
+		uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+		uintptr_t end = start + phdr->p_memsz;
 
-		data_segments->start[cnt] = PTR_ALIGN_UP(data_start);
-		data_segments->end[cnt] = PTR_ALIGN_DOWN(data_end);
-		data_segments->cnt = ++cnt;
+		/* what is left on each side of the RELRO range */
+		if (relro_start < relro_end && relro_start < end &&
+		    relro_end > start) {
+			regions_add(data_segments, start, relro_start);
+			regions_add(data_segments, relro_end, end);
+			continue;
+		}
+		regions_add(data_segments, start, end);
 	}
 	return 0;
 }
 
-static int trace_roots(struct stack_region_s *safe_stack)
+/* the counters are the same in every entry, the first one is enough */
+static int dynlibs_gen_cb(struct dl_phdr_info *info, size_t size, void *data)
 {
-	/* GLOBAL DATA SECTION */
-	static struct mem_regions_s data_segments = {.len = MAX_SEGMENTS};
-	data_segments.cnt = 0;
-	int ret;
-	ret = dl_iterate_phdr(dynlibs_data_cb, (void *)&data_segments);
-	if (ret) {
+	if (size < offsetof(struct dl_phdr_info, dlpi_subs) +
+		sizeof(info->dlpi_subs)) {
+		return -1;
+	}
+	unsigned long long *gen = (unsigned long long *)data;
+	gen[0] = info->dlpi_adds;
+	gen[1] = info->dlpi_subs;
+	return 1;
+}
+
+/*
+ * rebuilds the root table only if objects were loaded or unloaded since it
+ * was last built. Without the counters it is rebuilt every time.
+ */
+static int roots_refresh(void)
+{
+	unsigned long long gen[2];
+	int ret = dl_iterate_phdr(dynlibs_gen_cb, gen);
+	if (ret == 1 && roots_gen.valid && gen[0] == roots_gen.adds &&
+	    gen[1] == roots_gen.subs) {
+		return EXIT_SUCCESS;
+	}
+
+	roots_gen.valid = false;
+	root_hot_valid = false;
+	cycle.roots.cnt = 0;
+	if (dl_iterate_phdr(dynlibs_data_cb, (void *)&cycle.roots)) {
 		return EXIT_FAILURE;
 	}
-	struct stack_s worklist;
-	ret = stack_init(heap, &worklist);
-	if (ret) {
+	/* a dlopen racing with the walk only costs one extra rebuild */
+	roots_gen.valid = ret == 1;
+	roots_gen.adds = gen[0];
+	roots_gen.subs = gen[1];
+	return EXIT_SUCCESS;
+}
+
+static int ranges_push(struct root_ranges_s *r, uintptr_t *start,
+		       uintptr_t *end)
+{
+	/* adjacent pages are scanned as one range */
+	if (r->cnt > 0 && r->end[r->cnt - 1] == start) {
+		r->end[r->cnt - 1] = end;
+		return EXIT_SUCCESS;
+	}
+	if (r->cnt == r->len) {
+		size_t len = r->len ? r->len * 2 : MAX_SEGMENTS;
+		uintptr_t **s = mi_heap_realloc(heap, r->start,
+						len * sizeof(*s));
+		if (s == NULL) {
+			perror("ranges_push: mi_heap_realloc");
+			return EXIT_FAILURE;
+		}
+		r->start = s;
+		uintptr_t **e = mi_heap_realloc(heap, r->end,
+						len * sizeof(*e));
+		if (e == NULL) {
+			perror("ranges_push: mi_heap_realloc");
+			return EXIT_FAILURE;
+		}
+		r->end = e;
+		r->len = len;
+	}
+	r->start[r->cnt] = start;
+	r->end[r->cnt] = end;
+	r->cnt++;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * picks what the cycle scans out of cycle.roots. With dirty_roots, pages
+ * written since the last cycle are checked for words in the heap range and
+ * their bit in root_hot updated. Only pages whose bit is set are scanned,
+ * a clean page without heap words cannot have grown one.
+ */
+static int roots_select(void)
+{
+	if (!config.dirty_roots) {
+		cycle.scan.start = cycle.roots.start;
+		cycle.scan.end = cycle.roots.end;
+		cycle.scan.cnt = cycle.roots.cnt;
+		return EXIT_SUCCESS;
+	}
+
+	size_t pages = 0;
+	for (size_t i = 0; i < cycle.roots.cnt; i++) {
+		uintptr_t lo = (uintptr_t)cycle.roots.start[i] &
+			       ~(DIRTY_PAGE_SIZE - 1);
+		pages += ((uintptr_t)cycle.roots.end[i] - lo +
+			  DIRTY_PAGE_SIZE - 1) >> DIRTY_PAGE_SHIFT;
+	}
+	if (pages > root_hot_len) {
+		mi_free(root_hot);
+		root_hot = mi_heap_calloc(heap, BITMAP_WORDS(pages),
+					  sizeof(uint64_t));
+		if (root_hot == NULL) {
+			perror("roots_select: mi_heap_calloc");
+			root_hot_len = 0;
+			return EXIT_FAILURE;
+		}
+		root_hot_len = pages;
+		root_hot_valid = false;
+	}
+
+	const size_t batch = 512;
+	uint64_t dirty[BITMAP_WORDS(batch)];
+	size_t idx = 0;
+	cycle.scan.cnt = 0;
+	for (size_t i = 0; i < cycle.roots.cnt; i++) {
+		uintptr_t *start = cycle.roots.start[i];
+		uintptr_t *end = cycle.roots.end[i];
+		uintptr_t page = (uintptr_t)start & ~(DIRTY_PAGE_SIZE - 1);
+		for (; page < (uintptr_t)end; page += batch * DIRTY_PAGE_SIZE) {
+			size_t npages = ((uintptr_t)end - page +
+					 DIRTY_PAGE_SIZE - 1) >>
+					DIRTY_PAGE_SHIFT;
+			if (npages > batch) {
+				npages = batch;
+			}
+			if (dirty_pages(page, npages, dirty)) {
+				return EXIT_FAILURE;
+			}
+			for (size_t j = 0; j < npages; j++, idx++) {
+				uintptr_t *lo = (uintptr_t *)(page +
+							      j * DIRTY_PAGE_SIZE);
+				uintptr_t *hi = lo + DIRTY_PAGE_SIZE / sizeof(*lo);
+				lo = lo < start ? start : lo;
+				hi = hi > end ? end : hi;
+				if (!root_hot_valid || bitmap_test(dirty, j)) {
+					if (scan_next(lo, hi, heap_addr,
+						      heap_size) < hi) {
+						bitmap_set(root_hot, idx);
+					} else {
+						bitmap_clear(root_hot, idx);
+					}
+				}
+				if (bitmap_test(root_hot, idx) &&
+				    ranges_push(&cycle.scan, lo, hi)) {
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	}
+	root_hot_valid = true;
+	DBG_PRNT("root pages: %zu, ranges scanned: %zu\n", pages,
+		 cycle.scan.cnt);
+	return EXIT_SUCCESS;
+}
+
+/* scales a per call budget by the calls it is spent on */
+static size_t budget_for(size_t per_call, size_t calls)
+{
+	size_t budget = per_call * calls;
+	if (calls != 0 && budget / calls != per_call) {
+		return SIZE_MAX;
+	}
+	return budget;
+}
+
+static void sweep_start(void)
+{
+	sweep_cursor = 0;
+	sweep_end = BITMAP_WORDS(book_cnt);
+	sweep_frees = actual_frees_cnt;
+	sweeping = true;
+}
+
+/* sweeps at most budget bitmap words of what the last cycle left */
+static void sweep_step(size_t budget)
+{
+	if (!sweeping) {
+		return;
+	}
+	uint64_t t = stats_now();
+
+	for (; budget > 0 && sweep_cursor < sweep_end;
+	     budget--, sweep_cursor++) {
+		size_t w = sweep_cursor;
+		/* marked objects are left alone, only visit the live slots
+		 * that were not reached */
+		uint64_t unmarked = live_bits[w] & ~mark_bits[w];
+		while (unmarked != 0) {
+			size_t i = w * BITMAP_WORD_BITS + __builtin_ctzl(unmarked);
+			unmarked &= unmarked - 1;
+
+			if (!bitmap_test(free_bits, i) ||
+			    book_age[i] < config.unreachable) {
+				book_age[i]++;
+				continue;
+			}
+
+			/* current object is garbage, and was requested
+			 * to be freed  */
+			/* the entry first, a large block's size goes with it */
+			void *addr = (void *)book_addr(i);
+			book_del_entry(i);
+			block_free(addr);
+			actual_frees_cnt++;
+		}
+	}
+	sweep_ns += stats_now() - t;
+	if (sweep_cursor < sweep_end) {
+		return;
+	}
+	sweeping = false;
+	reclaims++;
+	if (PROBE_ENABLED(gc_sweep)) {
+		PROBE(gc_sweep, stats_now(), actual_frees_cnt - sweep_frees);
+	}
+
+	/* whatever survived is reachable, don't keep collecting on every
+	 * request until the heap has grown again */
+	if (config.high_water != 0) {
+		high_water = config.high_water;
+		if (live_bytes > high_water / 2) {
+			high_water = live_bytes * 2;
+		}
+	}
+}
+
+/* flag every pending request on its book entry, the pending list is empty
+ * afterwards */
+static void resolve_pending(void)
+{
+	while (!stack_is_empty(&pending)) {
+		void *ptr;
+		stack_pop(&pending, &ptr);
+		uint32_t idx;
+		if (addr_map_get(&book_map, (uintptr_t)ptr, &idx)) {
+			bitmap_set(free_bits, idx);
+		} else {
+			/* is this success or fail? */
+			DBG_PRNT("no object stored at addr: %p\n", ptr);
+		}
+	}
+	pending_bytes = 0;
+}
+
+static bool collection_due(void)
+{
+	if (stack_len(&pending) >= config.free_count) {
+		return true;
+	}
+	if (config.free_bytes != 0 && pending_bytes >= config.free_bytes) {
+		return true;
+	}
+	return config.high_water != 0 && live_bytes >= high_water;
+}
+
+static int par_init(void)
+{
+	par.cnt = pool_workers();
+	par.workers = mi_heap_calloc(heap, par.cnt, sizeof(*par.workers));
+	if (par.workers == NULL) {
+		perror("par_init: mi_heap_calloc");
 		return EXIT_FAILURE;
 	}
+	for (unsigned i = 0; i < par.cnt; i++) {
+		struct mark_worker_s *w = &par.workers[i];
+		if (deque_init(heap, &w->deque, DEQUE_CAP) ||
+		    stack_init(heap, &w->overflow)) {
+			return EXIT_FAILURE;
+		}
+		w->seed = i + 1;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int par_add_roots(uintptr_t *start, uintptr_t *end)
+{
+	for (; start < end; start += ROOT_CHUNK_WORDS) {
+		if (par.chunks_cnt == par.chunks_len) {
+			size_t len = par.chunks_len ? par.chunks_len * 2 : 256;
+			void *tmp = mi_heap_realloc(heap, par.chunks,
+						    len * sizeof(*par.chunks));
+			if (tmp == NULL) {
+				perror("par_add_roots: mi_heap_realloc");
+				return EXIT_FAILURE;
+			}
+			par.chunks = tmp;
+			par.chunks_len = len;
+		}
+		struct root_chunk_s *chunk = &par.chunks[par.chunks_cnt++];
+		chunk->start = start;
+		chunk->end = (size_t)(end - start) > ROOT_CHUNK_WORDS
+				 ? start + ROOT_CHUNK_WORDS
+				 : end;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* item: book slot in the low half, piece of the object in the high half */
+static int par_scan_item(struct mark_worker_s *w, uint64_t item)
+{
+	size_t i = (uint32_t)item;
+	size_t piece = item >> 32;
+	uintptr_t obj_addr = book_addr(i);
+	uintptr_t *start = (uintptr_t *)PTR_ALIGN_UP(obj_addr);
+	uintptr_t *end = (uintptr_t *)PTR_ALIGN_DOWN(obj_addr + entry_size(i));
+
+	start += piece * SPLIT_WORDS;
+	if (end - start > (ptrdiff_t)SPLIT_WORDS) {
+		/* publish the rest first, so thieves can take it */
+		if (par_push(w, item + (1UL << 32))) {
+			return EXIT_FAILURE;
+		}
+		end = start + SPLIT_WORDS;
+	}
+	return mark_from_region(w, start, end);
+}
 
-	DBG_PRNT("GLOBAL DATA SECTION:\n");
-	for (size_t i = 0; i < data_segments.cnt; i++) {
-		/*DBG_PRNT("start: %p\tend: %p\n",
-		 * roots_data.start[i],*/
-		/*	roots_data.end[i]);*/
-		ret = mark_from_region(&worklist, data_segments.start[i],
-				       data_segments.end[i]);
+static bool par_pop(struct mark_worker_s *w, uint64_t *item)
+{
+	if (deque_pop(&w->deque, item)) {
+		return true;
+	}
+	if (stack_is_empty(&w->overflow)) {
+		return false;
+	}
+	void *val;
+	stack_pop(&w->overflow, &val);
+	*item = (uint64_t)val;
+	return true;
+}
+
+static bool par_steal(struct mark_worker_s *w, uint64_t *item)
+{
+	/* xorshift, only needs to spread victims around */
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	for (unsigned k = 0; k < par.cnt; k++) {
+		struct mark_worker_s *victim =
+		    &par.workers[(w->seed + k) % par.cnt];
+		if (victim == w) {
+			continue;
+		}
+		for (int tries = 0; tries < STEAL_TRIES; tries++) {
+			enum DEQUE_STEAL ret = deque_steal(&victim->deque, item);
+			if (ret == STEAL_OK) {
+				return true;
+			}
+			if (ret == STEAL_EMPTY) {
+				break;
+			}
+		}
+	}
+	return false;
+}
+
+static bool par_work_visible(void)
+{
+	if (atomic_load(&par.next_chunk) < par.chunks_cnt) {
+		return true;
+	}
+	for (unsigned i = 0; i < par.cnt; i++) {
+		if (!deque_is_empty(&par.workers[i].deque)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * called with nothing left to do. Work only ever comes from busy workers,
+ * so once every worker is idle at the same time marking is over.
+ */
+static bool par_terminate(void)
+{
+	atomic_fetch_add(&par.idle, 1);
+	for (;;) {
+		if (atomic_load(&par.idle) == par.cnt ||
+		    atomic_load(&par.failed)) {
+			return true;
+		}
+		if (par_work_visible()) {
+			atomic_fetch_sub(&par.idle, 1);
+			return false;
+		}
+		sched_yield();
+	}
+}
+
+static void mark_worker(unsigned id, void *arg)
+{
+	(void)arg;
+	struct mark_worker_s *w = &par.workers[id];
+	w->heap = mi_heap_get_default();
+
+	for (;;) {
+		uint64_t item;
+		int ret = EXIT_SUCCESS;
+		if (par_pop(w, &item) || par_steal(w, &item)) {
+			ret = par_scan_item(w, item);
+		} else {
+			size_t next = atomic_fetch_add(&par.next_chunk, 1);
+			if (next < par.chunks_cnt) {
+				struct root_chunk_s *chunk = &par.chunks[next];
+				ret = mark_from_region(w, chunk->start,
+						       chunk->end);
+			} else if (par_terminate()) {
+				return;
+			}
+		}
 		if (ret) {
+			atomic_store(&par.failed, true);
+			return;
+		}
+	}
+}
+
+/* marks from all roots (safe stack included) on every pool thread */
+static int mark_parallel(const struct stack_region_s *stacks, size_t cnt)
+{
+	uint64_t t = stats_now();
+	if (par.workers == NULL && par_init()) {
+		return EXIT_FAILURE;
+	}
+
+	par.chunks_cnt = 0;
+	for (size_t i = 0; i < cycle.scan.cnt; i++) {
+		if (par_add_roots(cycle.scan.start[i], cycle.scan.end[i])) {
+			return EXIT_FAILURE;
+		}
+	}
+	for (size_t i = 0; i < cnt; i++) {
+		if (par_add_roots(stacks[i].top, stacks[i].bottom)) {
 			return EXIT_FAILURE;
 		}
 	}
+	atomic_store(&par.next_chunk, 0);
+	atomic_store(&par.idle, 0);
+	atomic_store(&par.failed, false);
+
+	pool_run(mark_worker, NULL);
+
+	/* roots are done, mark_finish only has the stacks left to revisit.
+	 * Their time and probe are accounted for here already */
+	cycle.root = cycle.scan.cnt;
+	cycle.phase = MARK_HEAP;
+	cycle.cursor = cycle.end = NULL;
+	uint64_t now = stats_now();
+	mark_ns += now - t;
+	/* roots and heap were marked together */
+	if (PROBE_ENABLED(gc_roots)) {
+		PROBE(gc_roots, now, cycle.scan.cnt, probe_root_bytes());
+	}
+	return atomic_load(&par.failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int mark_start(void)
+{
+	/* the previous sweep still needs its mark bits, finish it first */
+	sweep_step(SIZE_MAX);
+	uint64_t t = stats_now();
+	resolve_pending();
 
-	/* STACK SECTION */
-	DBG_PRNT("SAFE STACK SECTION: %p - %p\n", safe_stack->top,
-		 safe_stack->bottom);
-	ret = mark_from_region(&worklist, safe_stack->top, safe_stack->bottom);
-	if (ret) {
+	/* fresh cycle, nothing is marked */
+	memset(mark_bits, 0, BITMAP_BYTES(book_cnt));
+
+	/* GLOBAL DATA SECTION */
+	if (roots_refresh()) {
+		return EXIT_FAILURE;
+	}
+
+	if (roots_select()) {
 		return EXIT_FAILURE;
 	}
 
-	ret = mark(&worklist);
-	if (ret) {
+	/* from here on, writes are picked up by the final rescan (and by the
+	 * next roots_select) */
+	if ((config.incremental || config.dirty_roots) && dirty_clear()) {
 		return EXIT_FAILURE;
 	}
 
+	stack_clear(&cycle.worklist);
+	cycle.root = 0;
+	cycle.cursor = cycle.end = NULL;
+	cycle.phase = MARK_ROOTS;
+	roots_ns += stats_now() - t;
+	PROBE(gc_start, t, live_objects, live_bytes);
 	return EXIT_SUCCESS;
 }
 
-static int sweep(void)
+/* rescans the words of [start, end) that sit on pages written since the
+ * cycle started */
+static int rescan_dirty_region(uintptr_t *start, uintptr_t *end)
 {
-	static const uint8_t UNREACHABLE_THRESHOLD = 1;
-	for (size_t i = 0; i < book_cnt; i++) {
-		if (book[i].addr == 0) {
-			continue;
+	const size_t batch = 512;
+	uint64_t dirty[BITMAP_WORDS(batch)];
+
+	uintptr_t page = (uintptr_t)start & ~(DIRTY_PAGE_SIZE - 1);
+	for (; page < (uintptr_t)end; page += batch * DIRTY_PAGE_SIZE) {
+		size_t npages = ((uintptr_t)end - page + DIRTY_PAGE_SIZE - 1) >>
+				DIRTY_PAGE_SHIFT;
+		if (npages > batch) {
+			npages = batch;
 		}
-		if (IS_MARKED(book[i].addr)) {
-			/* unmark */
-			book[i].addr = UNTAG(book[i].addr);
-			continue;
+		if (dirty_pages(page, npages, dirty)) {
+			return EXIT_FAILURE;
 		}
-		if (!book[i].requested_free ||
-		    book[i].unreachable_cnt < UNREACHABLE_THRESHOLD) {
-			book[i].unreachable_cnt++;
-			continue;
+		for (size_t j = 0; j < npages; j++) {
+			if (!bitmap_test(dirty, j)) {
+				continue;
+			}
+			uintptr_t *lo = (uintptr_t *)(page + j * DIRTY_PAGE_SIZE);
+			uintptr_t *hi = lo + DIRTY_PAGE_SIZE / sizeof(*lo);
+			if (mark_from_region(NULL,
+					     lo < start ? start : lo,
+					     hi > end ? end : hi)) {
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/* rescans the marked objects on a heap page. Unmarked ones are scanned in
+ * full if they get reached */
+static int rescan_heap_page(size_t page)
+{
+	uintptr_t *lo = (uintptr_t *)(heap_addr + (page << BOOK_PAGE_SHIFT));
+	uintptr_t *hi = lo + BOOK_PAGE_SIZE / sizeof(*lo);
+
+	uint32_t slot = page_spill[page];
+	if (slot == 0) {
+		slot = page_head[page];
+	}
+	while (slot != 0) {
+		size_t i = slot - 1;
+		if (bitmap_test(mark_bits, i) && !bitmap_test(noscan_bits, i)) {
+			uintptr_t obj_addr = book_addr(i);
+			uintptr_t *start = (uintptr_t *)PTR_ALIGN_UP(obj_addr);
+			uintptr_t *end = (uintptr_t *)PTR_ALIGN_DOWN(
+			    obj_addr + entry_size(i));
+			if (start < lo) {
+				start = lo;
+			}
+			if (end > hi) {
+				end = hi;
+			}
+			if (start < end &&
+			    mark_from_region(NULL, start, end)) {
+				return EXIT_FAILURE;
+			}
+		}
+		/* the spill object is not part of the page chain */
+		if (slot == page_spill[page]) {
+			slot = page_head[page];
+		} else {
+			slot = book_next[i];
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+static int rescan_dirty_heap(void)
+{
+	const size_t batch = 512;
+	uint64_t dirty[BITMAP_WORDS(batch)];
+
+	for (size_t page = 0; page < page_hi; page += batch) {
+		size_t npages = page_hi - page;
+		if (npages > batch) {
+			npages = batch;
+		}
+		uintptr_t addr = heap_addr + (page << BOOK_PAGE_SHIFT);
+		if (dirty_pages(addr, npages, dirty)) {
+			return EXIT_FAILURE;
+		}
+		for (size_t j = 0; j < npages; j++) {
+			if (bitmap_test(dirty, j) &&
+			    rescan_heap_page(page + j)) {
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * atomic end of a cycle. Conservative scanning has no write barrier, so an
+ * incremental cycle has to revisit whatever the mutator wrote while it was
+ * running (ptrs stored into already scanned objects or roots) before it
+ * is safe to sweep.
+ */
+static int mark_finish(const struct stack_region_s *stacks, size_t cnt)
+{
+	uint64_t t = stats_now();
+	if (config.incremental) {
+		for (size_t i = 0; i < cycle.roots.cnt; i++) {
+			if (rescan_dirty_region(cycle.roots.start[i],
+						cycle.roots.end[i])) {
+				return EXIT_FAILURE;
+			}
+		}
+		if (rescan_dirty_heap()) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	uint64_t now = stats_now();
+	mark_ns += now - t;
+	t = now;
+
+	/* STACK SECTION, one safe stack per thread in a safe block */
+	for (size_t i = 0; i < cnt; i++) {
+		DBG_PRNT("SAFE STACK SECTION: %p - %p\n", stacks[i].top,
+			 stacks[i].bottom);
+		if (mark_from_region(NULL, stacks[i].top, stacks[i].bottom)) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	roots_ns += stats_now() - t;
+
+	bool done;
+	if (mark_step(SIZE_MAX, &done)) {
+		return EXIT_FAILURE;
+	}
+	cycle.phase = MARK_IDLE;
+	collections_cnt++;
+	blacklist_publish();
+	if (PROBE_ENABLED(gc_mark)) {
+		size_t marked = 0;
+		for (size_t i = 0; i < BITMAP_WORDS(book_cnt); i++) {
+			marked += __builtin_popcountl(mark_bits[i]);
 		}
+		PROBE(gc_mark, stats_now(), marked);
+	}
+	if (PROBE_ENABLED(gc_end)) {
+		PROBE(gc_end, stats_now(), roots_ns, mark_ns);
+	}
 
-		/* current object is garbage, and was requested
-		 * to be freed  */
-		mi_free((void *)book[i].addr);
-		book_del_entry((void *)book[i].addr);
-		actual_frees_cnt++;
+	/* garbage is handed back over the following calls, unless the sweep
+	 * budget asks for it right away */
+	sweep_start();
+	if (config.sweep_budget == 0) {
+		sweep_step(SIZE_MAX);
 	}
 	return EXIT_SUCCESS;
 }
 
-int bookkeeper_request_free(void *ptr, struct stack_region_s *safe_stack)
+void bookkeeper_thread_init(mi_heap_t *thread_heap)
+{
+	heap = thread_heap;
+}
+
+/* the rest of a stop-the-world cycle mark_start began */
+static int mark_all(const struct stack_region_s *stacks, size_t cnt)
+{
+	if (pool_workers() > 1) {
+		if (mark_parallel(stacks, cnt)) {
+			return EXIT_FAILURE;
+		}
+		return mark_finish(stacks, cnt);
+	}
+	bool done;
+	if (mark_step(SIZE_MAX, &done)) {
+		return EXIT_FAILURE;
+	}
+	return mark_finish(stacks, cnt);
+}
+
+/*
+ * never returns. The other threads were stopped anywhere and may hold the
+ * locks of mimalloc or stdio, which stay held in here: nothing may
+ * allocate or print, only raw syscalls and _exit are safe.
+ */
+static void snapshot_child(const struct stack_region_s *stacks, size_t cnt)
+{
+#ifdef _BOOKKEEPER_DEBUG
+	dbg_quiet = true;
+#endif
+	/* a slot is pushed at most once, when it gets marked, so a worklist
+	 * with room for all of them never has to grow. Without a heap, a push
+	 * that would have to fails */
+	size_t len = book_cnt + 1;
+	void *buf = mmap(NULL, len * sizeof(void *), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (buf == MAP_FAILED || len > INT32_MAX) {
+		_exit(EXIT_FAILURE);
+	}
+	cycle.worklist =
+	    (struct stack_s){.stack = buf, .size = (int32_t)len, .top = -1};
+	heap = NULL;
+
+	for (size_t i = 0; i < cnt; i++) {
+		if (mark_from_region(NULL, stacks[i].top, stacks[i].bottom)) {
+			_exit(EXIT_FAILURE);
+		}
+	}
+	bool done;
+	if (mark_step(SIZE_MAX, &done)) {
+		_exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < snap.words; i++) {
+		snap.res->garbage[i] = live_bits[i] & free_bits[i] & ~mark_bits[i];
+	}
+	blacklist_export(snap.res->garbage + snap.words);
+	__atomic_store_n(&snap.res->done, 1, __ATOMIC_RELEASE);
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * world stopped. Takes the snapshot, the child marks it. A raw clone with
+ * no exit signal: no atfork handlers waiting on locks a stopped thread may
+ * hold, and neither SIGCHLD nor waitpid(-1) in the program see the child.
+ * Marks in place when that fails.
+ */
+static int snapshot_start(const struct stack_region_s *stacks, size_t cnt)
+{
+	if (mark_start()) {
+		return EXIT_FAILURE;
+	}
+	snap.words = BITMAP_WORDS(book_cnt);
+	snap.res_bytes = sizeof(*snap.res) +
+			 (snap.words + blacklist_words()) * sizeof(uint64_t);
+	void *addr = mmap(NULL, snap.res_bytes, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("snapshot_start: mmap");
+		return mark_all(stacks, cnt);
+	}
+	snap.res = addr;
+
+	long pid = syscall(SYS_clone, 0, NULL, NULL, NULL, 0);
+	if (pid == -1) {
+		perror("snapshot_start: clone");
+		munmap(snap.res, snap.res_bytes);
+		return mark_all(stacks, cnt);
+	}
+	if (pid == 0) {
+		snapshot_child(stacks, cnt);
+	}
+
+	/* the parent doesn't mark, new objects need no black allocation */
+	snap.pid = pid;
+	cycle.phase = MARK_IDLE;
+	cycle.cursor = cycle.end = NULL;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * lock held. Sweeps what the child found once it exited, waiting for it if
+ * wait is set. Everything outside of its garbage counts as marked. A child
+ * that failed leaves the requests flagged for the next cycle.
+ */
+static void snapshot_poll(bool wait)
+{
+	if (snap.pid == 0) {
+		return;
+	}
+	pid_t ret;
+	do {
+		ret = waitpid(snap.pid, NULL, __WCLONE | (wait ? 0 : WNOHANG));
+	} while (ret == -1 && errno == EINTR);
+	if (ret == 0) {
+		return;
+	}
+
+	if (__atomic_load_n(&snap.res->done, __ATOMIC_ACQUIRE)) {
+		for (size_t i = 0; i < BITMAP_WORDS(book_cnt); i++) {
+			mark_bits[i] =
+			    i < snap.words ? ~snap.res->garbage[i] : ~0UL;
+		}
+		collections_cnt++;
+		blacklist_import(snap.res->garbage + snap.words);
+		blacklist_publish();
+		if (PROBE_ENABLED(gc_end)) {
+			PROBE(gc_end, stats_now(), roots_ns, mark_ns);
+		}
+		sweep_start();
+		if (config.sweep_budget == 0) {
+			sweep_step(SIZE_MAX);
+		}
+	} else {
+		char *err_msg = "WARNING: snapshot_poll: marking child failed\n";
+		write(STDERR_FILENO, err_msg, strlen(err_msg));
+	}
+	munmap(snap.res, snap.res_bytes);
+	snap.pid = 0;
+}
+
+/* lock held. Whatever the child finds would refer to stale slots */
+static void snapshot_cancel(void)
+{
+	if (snap.pid == 0) {
+		return;
+	}
+	kill(snap.pid, SIGKILL);
+	while (waitpid(snap.pid, NULL, __WCLONE) == -1 && errno == EINTR) {
+	}
+	munmap(snap.res, snap.res_bytes);
+	snap.pid = 0;
+}
+
+/*
+ * pays for calls hooked calls: sweeps part of what the last cycle left and
+ * advances an incremental cycle by budget words per call. ready is set
+ * once only bookkeeper_collect is left to end the cycle.
+ */
+int bookkeeper_step(size_t calls, bool *ready)
+{
+	*ready = false;
+	snapshot_poll(false);
+	sweep_step(budget_for(config.sweep_budget, calls));
+	if (cycle.phase == MARK_IDLE) {
+		return EXIT_SUCCESS;
+	}
+	return mark_step(budget_for(config.mark_budget, calls), ready);
+}
+
+int bookkeeper_request_free(void *ptr)
 {
 	/* for compatibility with actual free, see `man 3 free` */
 	if (ptr == NULL) {
 		return EXIT_SUCCESS;
 	}
-	/*
-	 * EACH FREE SHOULD GO TO A REQUEST LIST, WHEN THE LIST
-	 * FILLS UP, SCAN MEMORY TO CHECK WHICH OF THOSE OBJECTS
-	 * ARE SAFE TO FREE. But for now simply add flag on each
-	 * object...
-	 */
 	free_requests_cnt++;
-	static size_t requests = 0;
-	const int threshold = 1;
-	DBG_PRNT("stack_top: %p\n", safe_stack->top);
-	DBG_PRNT("stack_bottom: %p\n", safe_stack->bottom);
 
-	bool found_object = false;
-	for (size_t i = 0; i < book_cnt; i++) {
-		if (book[i].addr == 0 || book[i].addr != (uintptr_t)ptr) {
-			continue;
-		}
-		book[i].requested_free = true;
-		found_object = true;
-		break;
+	uintptr_t addr = (uintptr_t)ptr;
+	if (addr < heap_addr || addr >= heap_addr + heap_size) {
+		DBG_PRNT("no object stored at addr: %p\n", ptr);
+		return EXIT_SUCCESS;
 	}
 
-	if (!found_object) {
-		/* is this success or fail? */
-		DBG_PRNT("no object stored at addr: %p\n", ptr);
+	/* requests are only looked up once the next collection starts, until
+	 * then just queue them up */
+	if (stack_push(heap, &pending, ptr)) {
+		return EXIT_FAILURE;
+	}
+	/* only a block the book knows counts towards the byte threshold,
+	 * interior pointers and blocks already freed are left out */
+	uint32_t idx;
+	if (addr_map_get(&book_map, addr, &idx) &&
+	    !bitmap_test(free_bits, idx)) {
+		pending_bytes += entry_size(idx);
+	}
+	return EXIT_SUCCESS;
+}
+
+bool bookkeeper_collection_due(void)
+{
+	if (cycle.phase != MARK_IDLE || snap.pid != 0) {
+		return false;
+	}
+	/* requests age over several cycles, a snapshot is cheap enough to
+	 * chain them while the heap is close to its limit */
+	if (config.fork_mark && bookkeeper_heap_pressure() &&
+	    free_requests_cnt != actual_frees_cnt) {
+		return true;
+	}
+	return collection_due();
+}
+
+/*
+ * the other threads must be stopped, stacks holds the safe stack of every
+ * thread in a safe block. Runs a whole collection, or in incremental mode
+ * starts a cycle when idle and finishes it otherwise. In fork mode only the
+ * snapshot is taken here.
+ */
+int bookkeeper_collect(const struct stack_region_s *stacks, size_t cnt)
+{
+	if (cycle.phase != MARK_IDLE) {
+		return mark_finish(stacks, cnt);
+	}
+	if (config.fork_mark) {
+		/* nothing to do while a child is still marking */
+		return snap.pid != 0 ? EXIT_SUCCESS : snapshot_start(stacks, cnt);
 	}
 
-	if (requests++ % threshold != 0) {
+	if (mark_start()) {
+		return EXIT_FAILURE;
+	}
+	if (config.incremental) {
 		return EXIT_SUCCESS;
 	}
+	return mark_all(stacks, cnt);
+}
 
-	trace_roots(safe_stack);
-	sweep();
+bool bookkeeper_heap_pressure(void)
+{
+	return live_bytes >= heap_limit - heap_limit / 8;
+}
 
+/*
+ * same conditions as bookkeeper_collect. Backpressure for a heap close to
+ * its limit: whatever the mode, runs enough whole collections for every
+ * unreachable requested free object to go, and sweeps right away. If the
+ * heap is still close to the limit afterwards the limit grows, as long as
+ * the reservation allows.
+ */
+int bookkeeper_collect_full(const struct stack_region_s *stacks, size_t cnt)
+{
+	if (cycle.phase != MARK_IDLE && mark_finish(stacks, cnt)) {
+		return EXIT_FAILURE;
+	}
+	/* its result is as good as a cycle of ours */
+	snapshot_poll(true);
+	full_collections_cnt++;
+	for (size_t i = 0; i <= config.unreachable; i++) {
+		if (mark_start() || mark_all(stacks, cnt)) {
+			return EXIT_FAILURE;
+		}
+		sweep_step(SIZE_MAX);
+	}
+
+	if (bookkeeper_heap_pressure() && heap_limit < heap_size) {
+		heap_limit = heap_limit > heap_size / 2 ? heap_size
+							: heap_limit * 2;
+		DBG_PRNT("safe heap limit raised to %zu\n", heap_limit);
+	}
 	return EXIT_SUCCESS;
 }
 
+void bookkeeper_collect_wait(void)
+{
+	snapshot_poll(true);
+}
+
+/* the gauges and counters of the stats page */
+void bookkeeper_stats(struct gc_stats_s *st)
+{
+	st->collections = collections_cnt;
+	st->full_collections = full_collections_cnt;
+	st->reclaims = reclaims;
+	st->roots_ns = roots_ns;
+	st->mark_ns = mark_ns;
+	st->sweep_ns = sweep_ns;
+	st->live_bytes = live_bytes;
+	st->live_objects = live_objects;
+	st->pending_cnt = stack_len(&pending);
+	st->pending_bytes = pending_bytes;
+	st->heap_limit = heap_limit;
+	st->book_cnt = book_cnt;
+	st->book_len = book_len;
+	st->free_requests = free_requests_cnt;
+	st->actual_frees = actual_frees_cnt;
+	st->blacklist_pages = blacklist_cnt;
+}
+
+uint64_t bookkeeper_reclaims(void)
+{
+	return reclaims;
+}
+
+
 void bookkeeper_purge_all(void)
 {
+	snapshot_cancel();
 	for (size_t i = 0; i < book_cnt; i++) {
-		if (book[i].addr == 0) {
+		if (!bitmap_test(live_bits, i)) {
 			continue;
 		}
-		book[i].addr = UNTAG(book[i].addr);
-		mi_free((void *)book[i].addr);
-		book_del_entry((void *)book[i].addr);
+		page_index_remove(i);
+		block_free((void *)book_addr(i));
 	}
+	/* an unfinished cycle refers to slots that are gone now */
+	cycle.phase = MARK_IDLE;
+	cycle.cursor = cycle.end = NULL;
+	stack_clear(&cycle.worklist);
+	sweeping = false;
+	reclaims++;
+
+	/* every slot is empty now, start the book over */
+	memset(live_bits, 0, BITMAP_BYTES(book_cnt));
+	addr_map_clear(&book_map);
+	stack_clear(&pending);
+	pending_bytes = 0;
+	live_bytes = 0;
+	live_objects = 0;
+	book_cnt = 0;
+	free_slots = 0;
 }
 
 /*
@@ -339,16 +1789,16 @@ void bookkeeper_dump(void)
 	fprintf(stderr, "actual frees count: %lu\n", actual_frees_cnt);
 	fprintf(stderr, "addr:\t\tsize:\n");
 	for (size_t i = 0; i < book_cnt; i++) {
-		if (book[i].addr == 0) {
+		if (!bitmap_test(live_bits, i)) {
 			// empty slot
 			continue;
 		}
-		void *addr = (void *)book[i].addr;
+		void *addr = (void *)book_addr(i);
 		char *is_tagged = "NOT_TAGGED";
-		if (IS_MARKED(addr)) {
+		if (bitmap_test(mark_bits, i)) {
 			is_tagged = "TAGGED";
 		}
-		fprintf(stderr, "%p\t%u", (void *)UNTAG(addr), book[i].size);
+		fprintf(stderr, "%p\t%zu", addr, entry_size(i));
 		fprintf(stderr, "\t%s\n", is_tagged);
 	}
 }
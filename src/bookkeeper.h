@@ -4,13 +4,17 @@
 /*
  * BOOKKEEPING FOR RUNTIME. WILL BE CALLED FROM MALLOC HOOKS, WHICH MEANS
  * CALLING MALLOC IS NOT ALLOWED. (mi_heap_malloc AND FRIENDS ARE ALLOWED)
+ * NOT THREAD SAFE, THE RUNTIME ONLY CALLS IN WHILE HOLDING ITS LOCK.
  */
 
 #define _GNU_SOURCE
+#include "config.h"
 #include "stack.h"
+#include <assert.h>
 #include <link.h>
 #include <mimalloc.h>
 #include <stdalign.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -19,44 +23,62 @@
 #include <unistd.h>
 
 #ifdef _BOOKKEEPER_DEBUG
+/* set in the marking child of fork mode, a thread that isn't there may
+ * hold the lock of stderr */
+extern bool dbg_quiet;
 #define DBG_PRNT(fmt, args...)                                                 \
-	fprintf(stderr, "DEBUG: %s: " fmt, __func__, ##args)
+	do {                                                                   \
+		if (!dbg_quiet) {                                              \
+			fprintf(stderr, "DEBUG: %s: " fmt, __func__, ##args);  \
+		}                                                              \
+	} while (0)
 #else
 #define DBG_PRNT(fmt, args...)
 #endif
 
-/* assuming sizeof(uintptr_t) == 8 */
-#define UNTAG(p) ((uintptr_t)(p) & 0xfffffffffffffffe)
-#define IS_MARKED(p) ((uintptr_t)(p) & 0x1)
-
 #define PTR_ALIGN_UP(p) __builtin_align_up((p), alignof(void *))
 #define PTR_ALIGN_DOWN(p) __builtin_align_down((p), alignof(void *))
 
-#define MAX_SEGMENTS 64 /* max num of data segments */
+#define MAX_SEGMENTS 64 /* initial num of root ranges, grown on demand */
 
-struct alloc_data_s {
-	uintptr_t addr; /* easier to work with uintptr_t */
-	uint32_t size;
-	bool requested_free;
-	uint8_t unreachable_cnt;
-};
+/* granularity of the page index, independent of the OS page size */
+#define BOOK_PAGE_SHIFT 12
+#define BOOK_PAGE_SIZE (1UL << BOOK_PAGE_SHIFT)
 
-struct mem_regions_s {
-	uintptr_t *start[MAX_SEGMENTS];
-	uintptr_t *end[MAX_SEGMENTS];
-	uint32_t cnt;
-	uint32_t len;
-};
+/* mimalloc blocks are at least 8 byte aligned (its smallest bin), book
+ * offsets count these */
+#define BOOK_GRANULE_SHIFT 3
+#define BOOK_GRANULE (1UL << BOOK_GRANULE_SHIFT)
+
+/* book sizes are 32-bit. Bigger blocks only fit the large object space,
+ * which keeps their sizes itself */
+#define BOOK_MAX_SIZE UINT32_MAX
 
 struct stack_region_s {
 	uintptr_t *top;
 	uintptr_t *bottom;
 };
 
-int bookkeeper_init(mi_heap_t *heap, void *heap_addr, size_t heap_size);
-int bookkeeper_add(void *addr, size_t size);
+int bookkeeper_init(mi_heap_t *heap, void *heap_addr, size_t heap_size,
+		    const struct gc_config_s *config);
+/* noscan objects are tracked like the others, but never scanned */
+int bookkeeper_add(void *addr, size_t size, bool noscan);
+bool bookkeeper_lookup(void *addr, size_t *size, bool *noscan);
 int bookkeeper_exit(void);
-int bookkeeper_request_free(void *ptr, struct stack_region_s *safe_stack);
+void bookkeeper_thread_init(mi_heap_t *thread_heap);
+int bookkeeper_request_free(void *ptr);
+bool bookkeeper_collection_due(void);
+int bookkeeper_step(size_t calls, bool *ready);
+int bookkeeper_collect(const struct stack_region_s *stacks, size_t cnt);
+int bookkeeper_collect_full(const struct stack_region_s *stacks, size_t cnt);
+/* fork mode: waits for the marking child, if any, and sweeps its result */
+void bookkeeper_collect_wait(void);
+/* live bytes are close to the safe heap limit */
+bool bookkeeper_heap_pressure(void);
 void bookkeeper_purge_all(void);
+/* bumped whenever a sweep or a purge handed memory back to mimalloc */
+uint64_t bookkeeper_reclaims(void);
+struct gc_stats_s;
+void bookkeeper_stats(struct gc_stats_s *st);
 void bookkeeper_dump(void);
 #endif
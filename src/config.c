@@ -0,0 +1,165 @@
+#include "config.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+static const char *trim_names[] = {"never", "sweep", "force"};
+static const char *oom_names[] = {"fail", "abort", "unsafe"};
+
+static size_t invalid(const char *name, const char *val, size_t dflt)
+{
+	fprintf(stderr, "WARNING: config: ignoring invalid %s=%s\n", name, val);
+	return dflt;
+}
+
+/* accepts plain numbers, optionally followed by a K, M or G suffix */
+static size_t env_size(const char *name, size_t dflt)
+{
+	const char *val = getenv(name);
+	if (val == NULL || *val == '\0') {
+		return dflt;
+	}
+
+	char *end;
+	errno = 0;
+	unsigned long long num = strtoull(val, &end, 0);
+	if (errno != 0 || end == val) {
+		return invalid(name, val, dflt);
+	}
+	unsigned int shift;
+	switch (*end) {
+	case 'G':
+	case 'g':
+		shift = 30;
+		break;
+	case 'M':
+	case 'm':
+		shift = 20;
+		break;
+	case 'K':
+	case 'k':
+		shift = 10;
+		break;
+	case '\0':
+		shift = 0;
+		break;
+	default:
+		return invalid(name, val, dflt);
+	}
+	if ((shift != 0 && end[1] != '\0') || num > SIZE_MAX >> shift) {
+		return invalid(name, val, dflt);
+	}
+	return num << shift;
+}
+
+/* 0 or 1, nothing else */
+static bool env_bool(const char *name, bool dflt)
+{
+	const char *val = getenv(name);
+	if (val == NULL || *val == '\0') {
+		return dflt;
+	}
+	if ((val[0] != '0' && val[0] != '1') || val[1] != '\0') {
+		return invalid(name, val, dflt);
+	}
+	return val[0] == '1';
+}
+
+/* an enum value, by its number or its name in names */
+static size_t env_enum(const char *name, const char **names, size_t cnt,
+		       size_t dflt)
+{
+	const char *val = getenv(name);
+	if (val == NULL || *val == '\0') {
+		return dflt;
+	}
+	for (size_t i = 0; i < cnt; i++) {
+		if (strcasecmp(val, names[i]) == 0) {
+			return i;
+		}
+	}
+	if (val[0] >= '0' && val[0] < '0' + (int)cnt && val[1] == '\0') {
+		return val[0] - '0';
+	}
+	return invalid(name, val, dflt);
+}
+
+static size_t align_heap_size(size_t size)
+{
+	if (size < HEAP_SIZE_ALIGN) {
+		return HEAP_SIZE_ALIGN;
+	}
+	if (size > HEAP_MAX_LIMIT) {
+		return HEAP_MAX_LIMIT;
+	}
+	return (size + HEAP_SIZE_ALIGN - 1) & ~(HEAP_SIZE_ALIGN - 1);
+}
+
+void config_init(struct gc_config_s *config)
+{
+	config->free_count = env_size("SAFE_GC_FREE_COUNT", DEFAULT_FREE_COUNT);
+	config->free_bytes = env_size("SAFE_GC_FREE_BYTES", DEFAULT_FREE_BYTES);
+	config->high_water = env_size("SAFE_GC_HIGH_WATER", DEFAULT_HIGH_WATER);
+	config->incremental = env_bool("SAFE_GC_INCREMENTAL", false);
+	config->mark_budget =
+	    env_size("SAFE_GC_MARK_BUDGET", DEFAULT_MARK_BUDGET);
+	config->gc_threads = env_size("SAFE_GC_THREADS", 0);
+	config->dirty_roots = env_bool("SAFE_GC_DIRTY_ROOTS", false);
+	config->sweep_budget =
+	    env_size("SAFE_GC_SWEEP_BUDGET", DEFAULT_SWEEP_BUDGET);
+	config->noscan_min = env_size("SAFE_GC_NOSCAN_MIN", 0);
+	config->large_min = env_size("SAFE_GC_LARGE_MIN", DEFAULT_LARGE_MIN);
+	config->trim = env_enum("SAFE_GC_TRIM", trim_names,
+				TRIM_FORCE + 1, TRIM_SWEEP);
+	config->oom = env_enum("SAFE_GC_OOM", oom_names, OOM_UNSAFE + 1,
+			       OOM_FAIL);
+	config->stats = env_bool("SAFE_GC_STATS", false);
+	config->blacklist = env_bool("SAFE_GC_BLACKLIST", true);
+	config->quarantine = env_size("SAFE_GC_QUARANTINE", 0);
+	if (config->quarantine != 0) {
+		/* nothing is marked, so nothing is blacklisted either */
+		config->blacklist = false;
+	}
+	config->fork_mark = env_bool("SAFE_GC_FORK", false);
+	if (config->fork_mark) {
+		/* the child's marks and root hints die with it */
+		config->incremental = false;
+		config->dirty_roots = false;
+	}
+
+	/* no room to grow unless asked for */
+	config->heap_size = align_heap_size(
+	    env_size("SAFE_GC_HEAP_SIZE", DEFAULT_HEAP_SIZE));
+	config->heap_max =
+	    align_heap_size(env_size("SAFE_GC_HEAP_MAX", config->heap_size));
+	if (config->heap_max < config->heap_size) {
+		config->heap_max = config->heap_size;
+	}
+	config->heap_hint = env_size("SAFE_GC_HEAP_HINT", DEFAULT_HEAP_HINT);
+	config->large_space = env_size("SAFE_GC_LARGE_SPACE",
+				       config->heap_max / DEFAULT_LARGE_SPACE_DIV);
+	if (config->large_space > config->heap_max - MIN_ARENA_SIZE) {
+		config->large_space = config->heap_max - MIN_ARENA_SIZE;
+	}
+	config->large_space &= ~(MIN_ARENA_SIZE - 1);
+
+	/* book ages are 8-bit and keep counting for reachable objects */
+	config->unreachable = env_size("SAFE_GC_UNREACHABLE",
+				       DEFAULT_UNREACHABLE);
+	if (config->unreachable > UINT8_MAX - 1) {
+		config->unreachable = UINT8_MAX - 1;
+	}
+	config->init_length =
+	    env_size("SAFE_GC_INIT_LENGTH", DEFAULT_INIT_LENGTH);
+	if (config->init_length == 0 || config->init_length > UINT32_MAX / 2) {
+		config->init_length = DEFAULT_INIT_LENGTH;
+	}
+	if (config->mark_budget == 0) {
+		config->mark_budget = 1;
+	}
+	if (config->free_count == 0) {
+		/* 0 would never trigger, treat it as collect on every free */
+		config->free_count = 1;
+	}
+}
@@ -0,0 +1,91 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/*
+ * RUNTIME TUNABLES, READ ONCE FROM THE ENVIRONMENT DURING hook_init. ONLY
+ * getenv/strtoull/strcasecmp ARE USED, SO THIS IS SAFE TO CALL BEFORE THE
+ * HOOKS ARE UP. A VALUE THAT DOESN'T PARSE IS WARNED ABOUT AND IGNORED.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* collect once this many free requests are pending */
+#define DEFAULT_FREE_COUNT 1024
+/* or once the pending requests add up to this many bytes */
+#define DEFAULT_FREE_BYTES (8UL * 1024 * 1024)
+/* or once the live safe heap grows past this many bytes */
+#define DEFAULT_HIGH_WATER (256UL * 1024 * 1024)
+
+/* words scanned per malloc/free while an incremental cycle is running */
+#define DEFAULT_MARK_BUDGET 4096
+/* bitmap words (64 book slots each) swept per malloc/free after a cycle */
+#define DEFAULT_SWEEP_BUDGET 16
+/* safe allocations this big go to the large object space */
+#define DEFAULT_LARGE_MIN (1024UL * 1024)
+/* the large object space is this part of SAFE_GC_HEAP_MAX by default, a
+ * quarter. Rounded down to MIN_ARENA_SIZE, and mimalloc keeps at least that
+ * much of the reserved space */
+#define DEFAULT_LARGE_SPACE_DIV 4
+#define MIN_ARENA_SIZE (64UL * 1024 * 1024)
+
+/* the safe heap starts with a soft limit of this many live bytes. The
+ * address space reserved for it (SAFE_GC_HEAP_MAX) is the most it can grow
+ * to, by default there is no room to */
+#define DEFAULT_HEAP_SIZE (4UL * 1024 * 1024 * 1024)
+#define DEFAULT_HEAP_HINT 0x300000000000UL
+/* book offsets are 32-bit counts of 8 byte granules */
+#define HEAP_MAX_LIMIT (32UL * 1024 * 1024 * 1024)
+/* sizes are rounded up to this, mimalloc arenas want big aligned chunks */
+#define HEAP_SIZE_ALIGN (256UL * 1024 * 1024)
+
+/* collections a requested free object stays unreachable before it goes */
+#define DEFAULT_UNREACHABLE 1
+/* book slots allocated up front */
+#define DEFAULT_INIT_LENGTH 1024
+
+/* what a safe allocation does once the heap is full, even after a forced
+ * full collection */
+enum gc_oom_e {
+	OOM_FAIL,   /* NULL and ENOMEM, like any allocator */
+	OOM_ABORT,  /* exit with an error */
+	OOM_UNSAFE, /* default allocator, the block is not UAF protected */
+};
+
+/* how threads hand emptied safe heap pages back to the OS */
+enum gc_trim_e {
+	TRIM_NEVER, /* RSS stays at its peak */
+	TRIM_SWEEP, /* collect the heap once a sweep is over */
+	TRIM_FORCE, /* same, and decommit right away instead of lazily */
+};
+
+/* byte thresholds can be set to 0 to disable them */
+struct gc_config_s {
+	size_t free_count; /* SAFE_GC_FREE_COUNT */
+	size_t free_bytes; /* SAFE_GC_FREE_BYTES */
+	size_t high_water; /* SAFE_GC_HIGH_WATER */
+	bool incremental;  /* SAFE_GC_INCREMENTAL */
+	size_t mark_budget; /* SAFE_GC_MARK_BUDGET */
+	size_t gc_threads;  /* SAFE_GC_THREADS, helpers for full collections */
+	bool dirty_roots;   /* SAFE_GC_DIRTY_ROOTS */
+	size_t sweep_budget; /* SAFE_GC_SWEEP_BUDGET, 0 sweeps at once */
+	size_t noscan_min;   /* SAFE_GC_NOSCAN_MIN, 0 disables */
+	size_t large_min;    /* SAFE_GC_LARGE_MIN, 0 disables */
+	size_t large_space;  /* SAFE_GC_LARGE_SPACE, tail of heap_max */
+	enum gc_trim_e trim; /* SAFE_GC_TRIM */
+	size_t heap_size;    /* SAFE_GC_HEAP_SIZE */
+	size_t heap_max;     /* SAFE_GC_HEAP_MAX */
+	uintptr_t heap_hint; /* SAFE_GC_HEAP_HINT */
+	size_t unreachable;  /* SAFE_GC_UNREACHABLE */
+	size_t init_length;  /* SAFE_GC_INIT_LENGTH */
+	enum gc_oom_e oom;   /* SAFE_GC_OOM */
+	bool stats;          /* SAFE_GC_STATS, shared memory stats page */
+	bool fork_mark;      /* SAFE_GC_FORK, mark a snapshot in a child */
+	bool blacklist;      /* SAFE_GC_BLACKLIST, avoid falsely pointed pages */
+	size_t quarantine;   /* SAFE_GC_QUARANTINE, byte budget, 0 traces */
+};
+
+void config_init(struct gc_config_s *config);
+
+#endif
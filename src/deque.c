@@ -0,0 +1,87 @@
+#include "deque.h"
+
+/*
+ * memory orderings follow "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP'13)
+ */
+
+int deque_init(mi_heap_t *heap, struct deque_s *d, size_t capacity)
+{
+	d->buf = mi_heap_malloc(heap, capacity * sizeof(uint64_t));
+	if (d->buf == NULL) {
+		perror("deque_init: mi_heap_malloc");
+		return EXIT_FAILURE;
+	}
+	d->mask = capacity - 1;
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+	return EXIT_SUCCESS;
+}
+
+void deque_fini(struct deque_s *d)
+{
+	mi_free((void *)d->buf);
+	d->buf = NULL;
+}
+
+bool deque_push(struct deque_s *d, uint64_t val)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+	if (b - t > d->mask) {
+		return false;
+	}
+	atomic_store_explicit(&d->buf[b & d->mask], val, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return true;
+}
+
+bool deque_pop(struct deque_s *d, uint64_t *val)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+	if (t > b) {
+		/* was already empty */
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		return false;
+	}
+	*val = atomic_load_explicit(&d->buf[b & d->mask], memory_order_relaxed);
+	if (t < b) {
+		return true;
+	}
+
+	/* last element, race thieves for it */
+	bool won = atomic_compare_exchange_strong_explicit(
+	    &d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return won;
+}
+
+enum DEQUE_STEAL deque_steal(struct deque_s *d, uint64_t *val)
+{
+	int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (t >= b) {
+		return STEAL_EMPTY;
+	}
+
+	*val = atomic_load_explicit(&d->buf[t & d->mask], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+						     memory_order_seq_cst,
+						     memory_order_relaxed)) {
+		return STEAL_ABORT;
+	}
+	return STEAL_OK;
+}
+
+bool deque_is_empty(struct deque_s *d)
+{
+	int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	return t >= b;
+}
@@ -0,0 +1,37 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <mimalloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * FIXED CAPACITY CHASE-LEV WORK-STEALING DEQUE. ONLY THE OWNER MAY PUSH AND
+ * POP (BOTTOM END), ANY THREAD MAY STEAL (TOP END). deque_push FAILS WHEN FULL,
+ * THE OWNER IS EXPECTED TO KEEP THE SURPLUS SOMEWHERE ELSE.
+ */
+
+enum DEQUE_STEAL {
+	STEAL_OK,
+	STEAL_EMPTY,
+	STEAL_ABORT, /* lost a race, worth retrying */
+};
+
+struct deque_s {
+	_Atomic int64_t top;
+	_Atomic int64_t bottom;
+	_Atomic uint64_t *buf;
+	int64_t mask; /* capacity - 1, capacity is a power of 2 */
+};
+
+int deque_init(mi_heap_t *heap, struct deque_s *d, size_t capacity);
+void deque_fini(struct deque_s *d);
+bool deque_push(struct deque_s *d, uint64_t val);
+bool deque_pop(struct deque_s *d, uint64_t *val);
+enum DEQUE_STEAL deque_steal(struct deque_s *d, uint64_t *val);
+bool deque_is_empty(struct deque_s *d);
+
+#endif
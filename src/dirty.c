@@ -0,0 +1,113 @@
+#include "dirty.h"
+#include "bitmap.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PM_SOFT_DIRTY (1UL << 55)
+#define PM_BATCH 512 /* pagemap entries read per pread */
+
+static int pagemap_fd = -1;
+static int clear_refs_fd = -1;
+static bool available = false;
+
+/* written to check that the kernel really sets soft-dirty bits */
+static volatile char probe[DIRTY_PAGE_SIZE]
+    __attribute__((aligned(DIRTY_PAGE_SIZE)));
+
+/*
+ * kernels without CONFIG_MEM_SOFT_DIRTY accept the clear_refs write but never
+ * set the bit, so the only way to know is to dirty a page and look.
+ */
+int dirty_init(void)
+{
+	pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (pagemap_fd == -1 || clear_refs_fd == -1) {
+		dirty_fini();
+		return EXIT_FAILURE;
+	}
+
+	available = true;
+	if (dirty_clear()) {
+		dirty_fini();
+		return EXIT_FAILURE;
+	}
+	probe[0] = 1;
+	uint64_t bit;
+	if (dirty_pages((uintptr_t)probe, 1, &bit) || (bit & 1) == 0) {
+		dirty_fini();
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+void dirty_fini(void)
+{
+	if (pagemap_fd != -1) {
+		close(pagemap_fd);
+	}
+	if (clear_refs_fd != -1) {
+		close(clear_refs_fd);
+	}
+	pagemap_fd = clear_refs_fd = -1;
+	available = false;
+}
+
+bool dirty_available(void)
+{
+	return available;
+}
+
+int dirty_clear(void)
+{
+	if (!available) {
+		return EXIT_SUCCESS;
+	}
+	/* 4: clear soft-dirty bits, see Documentation/admin-guide/mm */
+	if (pwrite(clear_refs_fd, "4", 1, 0) != 1) {
+		perror("dirty_clear: write");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * sets bit i of bits if page (start >> DIRTY_PAGE_SHIFT) + i was written
+ * since the last dirty_clear. Without soft-dirty support every page is
+ * reported dirty, which is always safe.
+ */
+int dirty_pages(uintptr_t start, size_t npages, uint64_t *bits)
+{
+	if (!available) {
+		memset(bits, 0xff, BITMAP_BYTES(npages));
+		return EXIT_SUCCESS;
+	}
+	memset(bits, 0, BITMAP_BYTES(npages));
+
+	uint64_t entries[PM_BATCH];
+	size_t first = start >> DIRTY_PAGE_SHIFT;
+	for (size_t done = 0; done < npages;) {
+		size_t n = npages - done;
+		if (n > PM_BATCH) {
+			n = PM_BATCH;
+		}
+		off_t off = (first + done) * sizeof(uint64_t);
+		ssize_t got = pread(pagemap_fd, entries, n * sizeof(uint64_t),
+				    off);
+		if (got <= 0) {
+			perror("dirty_pages: pread");
+			return EXIT_FAILURE;
+		}
+		n = got / sizeof(uint64_t);
+		for (size_t i = 0; i < n; i++) {
+			if (entries[i] & PM_SOFT_DIRTY) {
+				bitmap_set(bits, done + i);
+			}
+		}
+		done += n;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#ifndef DIRTY_H
+#define DIRTY_H
+#define _GNU_SOURCE
+
+/*
+ * PAGE DIRTY TRACKING THROUGH LINUX SOFT-DIRTY BITS. clear_refs RESETS THE
+ * BITS OF THE WHOLE PROCESS, pagemap TELLS WHICH PAGES WERE WRITTEN SINCE.
+ * ONLY open/pread/write ARE USED, NO MALLOC.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIRTY_PAGE_SHIFT 12 /* pagemap has one entry per 4KiB page */
+#define DIRTY_PAGE_SIZE (1UL << DIRTY_PAGE_SHIFT)
+
+int dirty_init(void);
+void dirty_fini(void);
+bool dirty_available(void);
+int dirty_clear(void);
+int dirty_pages(uintptr_t start, size_t npages, uint64_t *bits);
+
+#endif
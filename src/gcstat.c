@@ -0,0 +1,119 @@
+#include "stats.h"
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * gcstat <pid> [interval]
+ * prints the GC stats a process running with the runtime publishes, every
+ * interval seconds until it exits when one is given.
+ */
+
+static const struct gc_stats_s *map_stats(pid_t pid)
+{
+	const struct gc_stats_s *st = stats_map(pid);
+	if (st == NULL) {
+		fprintf(stderr, "gcstat: no stats page for %d: %s\n", pid,
+			strerror(errno));
+		return NULL;
+	}
+	if (st->magic != STATS_MAGIC || st->version != STATS_VERSION) {
+		fprintf(stderr, "gcstat: page of %d has magic %x version %u, "
+				"expected %x version %u\n",
+			pid, st->magic, st->version, STATS_MAGIC,
+			STATS_VERSION);
+		munmap((void *)st, sizeof(struct gc_stats_s));
+		return NULL;
+	}
+	return st;
+}
+
+/* a consistent copy, retried while the collector is rewriting the page */
+static void read_stats(const struct gc_stats_s *st, struct gc_stats_s *out)
+{
+	uint32_t seq;
+	do {
+		while ((seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE)) & 1) {
+			sched_yield();
+		}
+		__builtin_memcpy(out, (const void *)st, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&st->seq, __ATOMIC_RELAXED) != seq);
+}
+
+static void print_stats(const struct gc_stats_s *st)
+{
+#define PRINT(field) printf("%-18s %lu\n", #field, (unsigned long)st->field)
+	PRINT(collections);
+	PRINT(full_collections);
+	PRINT(reclaims);
+	PRINT(pause_cnt);
+	PRINT(pause_ns_total);
+	PRINT(pause_ns_max);
+	PRINT(roots_ns);
+	PRINT(mark_ns);
+	PRINT(sweep_ns);
+	PRINT(live_bytes);
+	PRINT(live_objects);
+	PRINT(pending_cnt);
+	PRINT(pending_bytes);
+	PRINT(heap_limit);
+	PRINT(book_cnt);
+	PRINT(book_len);
+	PRINT(free_requests);
+	PRINT(actual_frees);
+	PRINT(blacklist_pages);
+	PRINT(parked);
+	PRINT(quarantined);
+	PRINT(quarantine_releases);
+	PRINT(safe_enters);
+	PRINT(safe_exits);
+	PRINT(unsafe_toggles);
+	PRINT(trims);
+#undef PRINT
+
+	/* pause histogram, only the buckets that counted anything */
+	for (size_t i = 0; i < STATS_PAUSE_BUCKETS; i++) {
+		if (st->pause_hist[i] == 0) {
+			continue;
+		}
+		printf("pause_us<%-10lu %lu\n", 1UL << i,
+		       (unsigned long)st->pause_hist[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <pid> [interval]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	pid_t pid = strtol(argv[1], NULL, 10);
+	unsigned interval = argc == 3 ? strtoul(argv[2], NULL, 10) : 0;
+
+	const struct gc_stats_s *st = map_stats(pid);
+	if (st == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	struct gc_stats_s snap;
+	for (;;) {
+		read_stats(st, &snap);
+		print_stats(&snap);
+		if (interval == 0) {
+			break;
+		}
+		sleep(interval);
+		if (kill(pid, 0) == -1 && errno == ESRCH) {
+			break;
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+	return EXIT_SUCCESS;
+}
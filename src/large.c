@@ -0,0 +1,177 @@
+#include "large.h"
+#include "bitmap.h"
+#include "blacklist.h"
+#include "threads.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+uintptr_t large_base = 0;
+uintptr_t large_end = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t page_cnt;
+static uint64_t *used;     /* one bit per page */
+static uint32_t *extent;   /* pages of the block starting at a page, or 0 */
+static size_t rover = 0;   /* searches start here, then wrap around */
+
+/*
+ * a collection frees large blocks with the world stopped. A thread stopped
+ * while holding the lock would never let it have it, so the suspend signal
+ * waits until the lock is dropped again.
+ */
+static void lock_acquire(sigset_t *old)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIG_SUSPEND);
+	pthread_sigmask(SIG_BLOCK, &set, old);
+	pthread_mutex_lock(&lock);
+}
+
+static void lock_release(const sigset_t *old)
+{
+	pthread_mutex_unlock(&lock);
+	pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/* the metadata lives in the safe heap as well, heap is only used here */
+int large_init(mi_heap_t *heap, void *base, size_t size)
+{
+	page_cnt = size >> LARGE_PAGE_SHIFT;
+	used = mi_heap_calloc(heap, BITMAP_WORDS(page_cnt), sizeof(uint64_t));
+	extent = mi_heap_calloc(heap, page_cnt, sizeof(uint32_t));
+	if (used == NULL || extent == NULL) {
+		perror("large_init: mi_heap_calloc");
+		mi_free(used);
+		mi_free(extent);
+		used = NULL;
+		extent = NULL;
+		return EXIT_FAILURE;
+	}
+	large_base = (uintptr_t)base;
+	large_end = large_base + (page_cnt << LARGE_PAGE_SHIFT);
+	return EXIT_SUCCESS;
+}
+
+void large_fini(void)
+{
+	mi_free(used);
+	mi_free(extent);
+	used = NULL;
+	extent = NULL;
+	large_base = large_end = 0;
+}
+
+/* first page of n free ones in [from, to), SIZE_MAX if there are none.
+ * With avoid, blacklisted pages count as used */
+static size_t find_run(size_t from, size_t to, size_t n, bool avoid)
+{
+	size_t run = 0;
+	size_t p = from;
+	while (p < to) {
+		uintptr_t addr = large_base + (p << LARGE_PAGE_SHIFT);
+		uint64_t word = used[p / BITMAP_WORD_BITS];
+		bool whole = p % BITMAP_WORD_BITS == 0 &&
+			     p + BITMAP_WORD_BITS <= to;
+		if (whole && word == 0 &&
+		    !(avoid && blacklist_hit((void *)addr,
+					     BITMAP_WORD_BITS * LARGE_PAGE_SIZE))) {
+			run += BITMAP_WORD_BITS;
+			p += BITMAP_WORD_BITS;
+		} else if (whole && word == UINT64_MAX) {
+			run = 0;
+			p += BITMAP_WORD_BITS;
+		} else if (bitmap_test(used, p) ||
+			   (avoid && blacklist_hit((void *)addr, 1))) {
+			run = 0;
+			p++;
+		} else {
+			run++;
+			p++;
+		}
+		if (run >= n) {
+			return p - run;
+		}
+	}
+	return SIZE_MAX;
+}
+
+/* from the rover on, then from the start */
+static size_t find_free(size_t n, bool avoid)
+{
+	size_t p = find_run(rover, page_cnt, n, avoid);
+	if (p == SIZE_MAX) {
+		p = find_run(0, page_cnt, n, avoid);
+	}
+	return p;
+}
+
+/*
+ * page aligned and zeroed, pages are either untouched or were dropped by
+ * large_free. NULL once the space is full, the caller falls back to
+ * mimalloc then.
+ */
+void *large_alloc(size_t size)
+{
+	size_t n = (size + LARGE_PAGE_SIZE - 1) >> LARGE_PAGE_SHIFT;
+	if (n == 0 || n > page_cnt || n > UINT32_MAX) {
+		return NULL;
+	}
+
+	sigset_t old;
+	lock_acquire(&old);
+	/* false pointers into the run would keep it alive forever, only
+	 * fall back on blacklisted pages when there is no other room */
+	size_t p = SIZE_MAX;
+	if (__atomic_load_n(&blacklist_cnt, __ATOMIC_RELAXED) != 0) {
+		p = find_free(n, true);
+	}
+	if (p == SIZE_MAX) {
+		p = find_free(n, false);
+	}
+	if (p == SIZE_MAX) {
+		lock_release(&old);
+		return NULL;
+	}
+	for (size_t i = p; i < p + n; i++) {
+		bitmap_set(used, i);
+	}
+	extent[p] = n;
+	if (p == rover) {
+		rover = p + n;
+	}
+	lock_release(&old);
+	return (void *)(large_base + (p << LARGE_PAGE_SHIFT));
+}
+
+void large_free(void *ptr)
+{
+	size_t p = ((uintptr_t)ptr - large_base) >> LARGE_PAGE_SHIFT;
+	size_t n = extent[p];
+
+	/* still ours until the bits are cleared, no need to hold the lock for
+	 * the syscall */
+	if (madvise(ptr, n << LARGE_PAGE_SHIFT, MADV_DONTNEED) == -1) {
+		perror("large_free: madvise");
+	}
+
+	sigset_t old;
+	lock_acquire(&old);
+	for (size_t i = p; i < p + n; i++) {
+		bitmap_clear(used, i);
+	}
+	extent[p] = 0;
+	if (p < rover) {
+		rover = p;
+	}
+	lock_release(&old);
+}
+
+size_t large_usable_size(const void *ptr)
+{
+	size_t p = ((uintptr_t)ptr - large_base) >> LARGE_PAGE_SHIFT;
+	return (size_t)extent[p] << LARGE_PAGE_SHIFT;
+}
@@ -0,0 +1,35 @@
+#ifndef LARGE_H
+#define LARGE_H
+#define _GNU_SOURCE
+
+/*
+ * LARGE OBJECT SPACE, THE TAIL OF THE SAFE HEAP MAPPING. EVERY BLOCK GETS
+ * WHOLE PAGES OF ITS OWN, A FREE HANDS THEM BACK TO THE KERNEL WITH
+ * MADV_DONTNEED. BLOCKS START ON A PAGE, SO THEY ARE BOOK GRANULE ALIGNED
+ * LIKE THE mimalloc ONES. THREAD SAFE, ALSO FOR A COLLECTOR THAT STOPPED
+ * THE OTHER THREADS.
+ */
+
+#include <mimalloc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LARGE_PAGE_SHIFT 12
+#define LARGE_PAGE_SIZE (1UL << LARGE_PAGE_SHIFT)
+
+extern uintptr_t large_base;
+extern uintptr_t large_end;
+
+int large_init(mi_heap_t *heap, void *base, size_t size);
+void large_fini(void);
+void *large_alloc(size_t size);
+void large_free(void *ptr);
+size_t large_usable_size(const void *ptr);
+
+static inline bool large_owns(const void *ptr)
+{
+	return (uintptr_t)ptr >= large_base && (uintptr_t)ptr < large_end;
+}
+
+#endif
@@ -0,0 +1,114 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_HELPERS 256
+
+static pthread_t helpers[MAX_HELPERS];
+static unsigned helpers_cnt = 0;
+static void (*helper_init)(void);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;
+static pool_fn_t job_fn;
+static void *job_arg;
+static unsigned long job_gen = 0; /* bumped for every job */
+static unsigned job_running = 0;  /* helpers still working on it */
+static bool shutting_down = false;
+
+static void *helper_main(void *arg)
+{
+	unsigned id = (unsigned)(uintptr_t)arg;
+	if (helper_init) {
+		helper_init();
+	}
+
+	unsigned long seen = 0;
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (job_gen == seen && !shutting_down) {
+			pthread_cond_wait(&job_cv, &lock);
+		}
+		if (shutting_down) {
+			break;
+		}
+		seen = job_gen;
+		pool_fn_t fn = job_fn;
+		void *fn_arg = job_arg;
+		pthread_mutex_unlock(&lock);
+
+		fn(id, fn_arg);
+
+		pthread_mutex_lock(&lock);
+		if (--job_running == 0) {
+			pthread_cond_signal(&done_cv);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* thread_init runs first thing on every helper, e.g. to set up its pkru */
+int pool_init(unsigned nthreads, void (*thread_init)(void))
+{
+	if (nthreads > MAX_HELPERS) {
+		fprintf(stderr, "WARNING: pool_init: capping helpers to %d\n",
+			MAX_HELPERS);
+		nthreads = MAX_HELPERS;
+	}
+	helper_init = thread_init;
+	for (unsigned i = 0; i < nthreads; i++) {
+		/* worker 0 is whoever calls pool_run */
+		void *id = (void *)(uintptr_t)(i + 1);
+		int err = pthread_create(&helpers[i], NULL, helper_main, id);
+		if (err) {
+			fprintf(stderr, "pool_init: pthread_create: %s\n",
+				strerror(err));
+			pool_fini();
+			return EXIT_FAILURE;
+		}
+		helpers_cnt++;
+	}
+	return EXIT_SUCCESS;
+}
+
+void pool_fini(void)
+{
+	pthread_mutex_lock(&lock);
+	shutting_down = true;
+	pthread_cond_broadcast(&job_cv);
+	pthread_mutex_unlock(&lock);
+	for (unsigned i = 0; i < helpers_cnt; i++) {
+		pthread_join(helpers[i], NULL);
+	}
+	helpers_cnt = 0;
+}
+
+/* number of threads taking part in a job, caller included */
+unsigned pool_workers(void)
+{
+	return helpers_cnt + 1;
+}
+
+void pool_run(pool_fn_t fn, void *arg)
+{
+	pthread_mutex_lock(&lock);
+	job_fn = fn;
+	job_arg = arg;
+	job_running = helpers_cnt;
+	job_gen++;
+	pthread_cond_broadcast(&job_cv);
+	pthread_mutex_unlock(&lock);
+
+	fn(0, arg);
+
+	pthread_mutex_lock(&lock);
+	while (job_running != 0) {
+		pthread_cond_wait(&done_cv, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
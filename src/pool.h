@@ -0,0 +1,19 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * HELPER THREADS FOR THE COLLECTOR. THEY ARE CREATED ONCE (FROM hook_init)
+ * AND SLEEP UNTIL pool_run HANDS THEM A JOB. THE CALLING THREAD TAKES PART
+ * IN EVERY JOB AS WORKER 0.
+ */
+
+#include <stdbool.h>
+
+typedef void (*pool_fn_t)(unsigned id, void *arg);
+
+int pool_init(unsigned nthreads, void (*thread_init)(void));
+void pool_fini(void);
+unsigned pool_workers(void);
+void pool_run(pool_fn_t fn, void *arg);
+
+#endif
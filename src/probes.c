@@ -0,0 +1,10 @@
+#include "probes.h"
+
+#ifdef SAFE_GC_HAVE_PROBES
+/* bumped by the tracer for every attached probe */
+#define PROBE_SEMAPHORE(name)                                                  \
+	unsigned short safe_gc_##name##_semaphore                              \
+	    __attribute__((section(".probes"), visibility("hidden"))) = 0;
+SAFE_GC_PROBES(PROBE_SEMAPHORE)
+#undef PROBE_SEMAPHORE
+#endif
@@ -0,0 +1,54 @@
+#ifndef PROBES_H
+#define PROBES_H
+#define _GNU_SOURCE
+
+/*
+ * USDT PROBES (PROVIDER safe_gc) FOR perf AND bpftrace. EACH ONE IS A NOP
+ * UNTIL A TRACER ATTACHES, ARGUMENTS THAT COST SOMETHING TO COMPUTE ARE
+ * GUARDED BY PROBE_ENABLED, WHICH READS THE PROBE'S SEMAPHORE. BUILT WHEN
+ * <sys/sdt.h> IS AROUND (systemtap), -DSAFE_GC_NO_PROBES LEAVES THEM OUT.
+ *
+ * enter_safe_block(stack_bottom)    exit_safe_block(stack_bottom)
+ * malloc(addr, size)                free(addr, size)
+ * gc_start(ns, live_objects, live_bytes)
+ * gc_roots(ns, ranges, bytes)       gc_mark(ns, marked)
+ * gc_end(ns, roots_ns, mark_ns)     gc_sweep(ns, swept)
+ * ns are CLOCK_MONOTONIC timestamps, roots_ns and mark_ns the running
+ * totals of the stats page. free's size is the booked one (the usable
+ * size once flushed to the book), 0 when the pointer isn't a booked block.
+ */
+
+#define SAFE_GC_PROBES(X)                                                      \
+	X(enter_safe_block)                                                    \
+	X(exit_safe_block)                                                     \
+	X(malloc)                                                              \
+	X(free)                                                                \
+	X(gc_start)                                                            \
+	X(gc_roots)                                                            \
+	X(gc_mark)                                                             \
+	X(gc_end)                                                              \
+	X(gc_sweep)
+
+#if !defined(SAFE_GC_NO_PROBES) && __has_include(<sys/sdt.h>)
+#define SAFE_GC_HAVE_PROBES 1
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name)                                                  \
+	extern unsigned short safe_gc_##name##_semaphore                       \
+	    __attribute__((section(".probes"), visibility("hidden")));
+SAFE_GC_PROBES(PROBE_SEMAPHORE)
+#undef PROBE_SEMAPHORE
+
+#define PROBE(name, ...) STAP_PROBEV(safe_gc, name, __VA_ARGS__)
+#define PROBE_ENABLED(name)                                                    \
+	__builtin_expect(                                                      \
+	    __atomic_load_n(&safe_gc_##name##_semaphore, __ATOMIC_RELAXED), 0)
+#else
+#define PROBE(name, ...)                                                       \
+	do {                                                                   \
+	} while (0)
+#define PROBE_ENABLED(name) 0
+#endif
+
+#endif
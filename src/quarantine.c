@@ -0,0 +1,177 @@
+#include "quarantine.h"
+#include "bitmap.h"
+#include "large.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define QUARANTINE_INIT_LEN 1024
+
+static uintptr_t base_addr;
+static size_t granules;
+static uint64_t *live; /* set on the first granule of an allocated block */
+static size_t live_len; /* bytes of the mapping */
+
+/* only the part of the bitmap over granules in use gets committed */
+int quarantine_init(int pkey, void *base, size_t size)
+{
+	base_addr = (uintptr_t)base;
+	granules = size >> QUARANTINE_GRANULE_SHIFT;
+	live_len = BITMAP_BYTES(granules);
+	void *addr = mmap(NULL, live_len, PROT_NONE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("quarantine_init: mmap");
+		return EXIT_FAILURE;
+	}
+	if (pkey_mprotect(addr, live_len, PROT_READ | PROT_WRITE, pkey) ==
+	    -1) {
+		perror("quarantine_init: pkey_mprotect");
+		munmap(addr, live_len);
+		return EXIT_FAILURE;
+	}
+	live = addr;
+	return EXIT_SUCCESS;
+}
+
+void quarantine_exit(void)
+{
+	if (live != NULL) {
+		munmap(live, live_len);
+		live = NULL;
+	}
+}
+
+static bool granule_of(void *ptr, size_t *g)
+{
+	uintptr_t off = (uintptr_t)ptr - base_addr;
+	*g = off >> QUARANTINE_GRANULE_SHIFT;
+	return (uintptr_t)ptr >= base_addr &&
+	       (off & ((1UL << QUARANTINE_GRANULE_SHIFT) - 1)) == 0 &&
+	       *g < granules;
+}
+
+void quarantine_track(void *ptr)
+{
+	size_t g;
+	if (granule_of(ptr, &g)) {
+		__atomic_fetch_or(&live[g / BITMAP_WORD_BITS],
+				  1UL << (g % BITMAP_WORD_BITS),
+				  __ATOMIC_RELAXED);
+	}
+}
+
+/* a double free racing the first one only sees the bit once */
+bool quarantine_untrack(void *ptr)
+{
+	size_t g;
+	if (!granule_of(ptr, &g)) {
+		return false;
+	}
+	uint64_t bit = 1UL << (g % BITMAP_WORD_BITS);
+	uint64_t word = __atomic_fetch_and(&live[g / BITMAP_WORD_BITS], ~bit,
+					   __ATOMIC_RELAXED);
+	return (word & bit) != 0;
+}
+
+bool quarantine_live(void *ptr)
+{
+	size_t g;
+	if (!granule_of(ptr, &g)) {
+		return false;
+	}
+	uint64_t word =
+	    __atomic_load_n(&live[g / BITMAP_WORD_BITS], __ATOMIC_RELAXED);
+	return (word >> (g % BITMAP_WORD_BITS)) & 1;
+}
+
+static void block_free(void *ptr)
+{
+	if (large_owns(ptr)) {
+		large_free(ptr);
+	} else {
+		mi_free(ptr);
+	}
+}
+
+/*
+ * hands back every allocated block, returns how many. Words that read zero
+ * are only read, so the untouched part of the bitmap stays uncommitted. A
+ * block freed meanwhile is either claimed here or by its free, not both.
+ */
+size_t quarantine_purge(void)
+{
+	size_t purged = 0;
+	for (size_t w = 0; w < BITMAP_WORDS(granules); w++) {
+		if (__atomic_load_n(&live[w], __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		uint64_t word = __atomic_exchange_n(&live[w], 0,
+						    __ATOMIC_RELAXED);
+		while (word != 0) {
+			size_t g = w * BITMAP_WORD_BITS + __builtin_ctzl(word);
+			word &= word - 1;
+			block_free((void *)(base_addr +
+					    (g << QUARANTINE_GRANULE_SHIFT)));
+			purged++;
+		}
+	}
+	return purged;
+}
+
+/* unwraps the ring into a twice as large one */
+static int grow(mi_heap_t *heap, struct quarantine_s *q)
+{
+	size_t len = q->len == 0 ? QUARANTINE_INIT_LEN : 2 * q->len;
+	struct quarantine_entry_s *ring =
+	    mi_heap_malloc(heap, len * sizeof(*ring));
+	if (ring == NULL) {
+		perror("quarantine_push: mi_heap_malloc");
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < q->cnt; i++) {
+		ring[i] = q->ring[(q->head + i) & (q->len - 1)];
+	}
+	mi_free(q->ring);
+	q->ring = ring;
+	q->len = len;
+	q->head = 0;
+	return EXIT_SUCCESS;
+}
+
+int quarantine_push(mi_heap_t *heap, struct quarantine_s *q, void *ptr,
+		    size_t size)
+{
+	if (q->cnt == q->len && grow(heap, q)) {
+		return EXIT_FAILURE;
+	}
+	q->ring[(q->head + q->cnt) & (q->len - 1)] =
+	    (struct quarantine_entry_s){.ptr = ptr, .size = size};
+	q->cnt++;
+	q->bytes += size;
+	return EXIT_SUCCESS;
+}
+
+/* hands back the oldest blocks until at most budget bytes are left,
+ * returns how many */
+size_t quarantine_release(struct quarantine_s *q, size_t budget)
+{
+	size_t released = 0;
+	while (q->bytes > budget) {
+		struct quarantine_entry_s *e = &q->ring[q->head];
+		block_free(e->ptr);
+		q->bytes -= e->size;
+		q->head = (q->head + 1) & (q->len - 1);
+		q->cnt--;
+		released++;
+	}
+	return released;
+}
+
+void quarantine_fini(struct quarantine_s *q)
+{
+	quarantine_release(q, 0);
+	mi_free(q->ring);
+	memset(q, 0, sizeof(*q));
+}
@@ -0,0 +1,50 @@
+#ifndef QUARANTINE_H
+#define QUARANTINE_H
+#define _GNU_SOURCE
+
+/*
+ * QUARANTINE MODE, NO TRACING. A FREED SAFE BLOCK WAITS IN A FIFO OF ITS
+ * FREEING THREAD UNTIL THE BYTES QUEUED AFTER IT PUSH THE TOTAL OVER THE
+ * BUDGET, ONLY THEN IS IT HANDED BACK TO mimalloc OR THE LARGE OBJECT
+ * SPACE. A RING IN THE OWNER'S HEAP, GROWN BY DOUBLING. OWNER ONLY.
+ *
+ * WHICH BLOCKS ARE ALLOCATED IS KEPT OUTSIDE OF THEM: ONE BIT PER GRANULE
+ * OF THE SAFE HEAP, SET ON THE FIRST GRANULE OF EVERY ALLOCATED BLOCK.
+ * ATOMIC, ANY THREAD MAY FREE ANY BLOCK. PROTECTED BY THE SAFE HEAP'S PKEY.
+ */
+
+#include <mimalloc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* mimalloc's smallest alignment */
+#define QUARANTINE_GRANULE_SHIFT 3
+
+struct quarantine_entry_s {
+	void *ptr;
+	size_t size;
+};
+
+struct quarantine_s {
+	struct quarantine_entry_s *ring;
+	size_t len;  /* a power of two, or 0 before the first push */
+	size_t head; /* oldest entry */
+	size_t cnt;
+	size_t bytes;
+};
+
+int quarantine_init(int pkey, void *base, size_t size);
+void quarantine_exit(void);
+void quarantine_track(void *ptr);
+/* false, and nothing changes, if ptr isn't the start of an allocated block */
+bool quarantine_untrack(void *ptr);
+bool quarantine_live(void *ptr);
+size_t quarantine_purge(void);
+
+int quarantine_push(mi_heap_t *heap, struct quarantine_s *q, void *ptr,
+		    size_t size);
+size_t quarantine_release(struct quarantine_s *q, size_t budget);
+void quarantine_fini(struct quarantine_s *q);
+
+#endif
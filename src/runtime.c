@@ -1,22 +1,53 @@
 #define _GNU_SOURCE /* for RTLD_NEXT.  */
+#include "blacklist.h"
 #include "bookkeeper.h"
+#include "config.h"
+#include "large.h"
+#include "pool.h"
+#include "probes.h"
+#include "quarantine.h"
 #include "segment_heap.h"
+#include "stats.h"
+#include "threads.h"
 #include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 static struct safe_heap_s safe_heap;
-static struct stack_region_s safe_stack;
+static struct gc_config_s gc_config;
+static pthread_t init_thread; /* owns safe_heap.heap */
 
 typedef void *(*_malloc_t)(size_t);
 typedef void *(*_calloc_t)(size_t, size_t);
 typedef void *(*_realloc_t)(void *_Nullable, size_t);
 typedef void (*_free_t)(void *_Nullable);
+typedef int (*_posix_memalign_t)(void **, size_t, size_t);
+typedef void *(*_memalign_t)(size_t, size_t);
+typedef void *(*_reallocarray_t)(void *_Nullable, size_t, size_t);
+typedef size_t (*_usable_size_t)(void *_Nullable);
 static _malloc_t _malloc = NULL;
 static _calloc_t _calloc = NULL;
 static _realloc_t _realloc = NULL;
 static _free_t _free = NULL;
+static _posix_memalign_t _posix_memalign = NULL;
+static _memalign_t _aligned_alloc = NULL;
+static _memalign_t _memalign = NULL;
+static _malloc_t _valloc = NULL;
+static _malloc_t _pvalloc = NULL;
+static _reallocarray_t _reallocarray = NULL;
+static _usable_size_t _malloc_usable_size = NULL;
+
+/*
+ * the allocator behind _malloc only reaches into the safe heap when it is
+ * mimalloc overriding malloc itself, then its metadata is shared with the
+ * safe arena. Only in that case do calls outside safe blocks have to open
+ * the pkey, decided once in hook_init.
+ */
+static bool unsafe_needs_perm = true;
 
 /*
  * initialization flag to handle correct usage of hooked allocations during
@@ -31,6 +62,10 @@ static mi_heap_t *tmp_heap;
 static __thread char err_msg[ERR_MSG_LEN];
 static __thread bool in_safe_block = false;
 static __thread bool exempt = false;
+static __thread bool noscan = false;
+
+/* set while the safe heap can't take more, see relieve_pressure */
+static bool heap_exhausted = false;
 
 #define LOAD_SYMBOL_ONCE(hook, sym, type)                                      \
 	do {                                                                   \
@@ -48,6 +83,12 @@ static __thread bool exempt = false;
 		}                                                              \
 	} while (0)
 
+/* collector helpers never enter safe blocks, but need to read the safe heap */
+static void gc_thread_init(void)
+{
+	pkey_set_perm(safe_heap.pkey, RDWR);
+}
+
 /*
  * We're the last shared object to be loaded, so it's safe to use functions from
  * dependencies.
@@ -65,9 +106,34 @@ __attribute__((constructor)) static void hook_init(void)
 	LOAD_SYMBOL_ONCE(_calloc, "calloc", _calloc_t);
 	LOAD_SYMBOL_ONCE(_realloc, "realloc", _realloc_t);
 	LOAD_SYMBOL_ONCE(_free, "free", _free_t);
+	LOAD_SYMBOL_ONCE(_posix_memalign, "posix_memalign", _posix_memalign_t);
+	LOAD_SYMBOL_ONCE(_aligned_alloc, "aligned_alloc", _memalign_t);
+	LOAD_SYMBOL_ONCE(_memalign, "memalign", _memalign_t);
+	LOAD_SYMBOL_ONCE(_valloc, "valloc", _malloc_t);
+	LOAD_SYMBOL_ONCE(_pvalloc, "pvalloc", _malloc_t);
+	LOAD_SYMBOL_ONCE(_reallocarray, "reallocarray", _reallocarray_t);
+	LOAD_SYMBOL_ONCE(_malloc_usable_size, "malloc_usable_size",
+			 _usable_size_t);
+
+	Dl_info next_info = {0}, mi_info;
+	if (dladdr((void *)_malloc, &next_info) &&
+	    dladdr((void *)mi_malloc, &mi_info) &&
+	    next_info.dli_fbase != mi_info.dli_fbase) {
+		unsafe_needs_perm = false;
+	}
+	DBG_PRNT("default allocator from %s, pkey toggles: %d\n",
+		 next_info.dli_fname, unsafe_needs_perm);
+
+	config_init(&gc_config);
+	if (gc_config.trim == TRIM_FORCE) {
+		/* segments emptied by a trim are decommitted right away */
+		mi_option_set(mi_option_purge_delay, 0);
+	}
 
 	int ret;
-	ret = create_safe_heap(&safe_heap);
+	ret = create_safe_heap(&safe_heap, gc_config.heap_max,
+			       gc_config.large_space,
+			       (void *)gc_config.heap_hint);
 	if (ret == EXIT_FAILURE) {
 		fprintf(stderr, "ERROR: create_safe_heap failed, exiting...\n");
 		exit(EXIT_FAILURE);
@@ -77,13 +143,53 @@ __attribute__((constructor)) static void hook_init(void)
 	pkey_set_perm(safe_heap.pkey, RDWR);
 
 	ret = bookkeeper_init(safe_heap.heap, safe_heap.mmap_addr,
-			      safe_heap.heap_size);
+			      safe_heap.heap_size, &gc_config);
 	if (ret == EXIT_FAILURE) {
 		fprintf(stderr, "ERROR: bookkeeper_init failed, exiting...\n");
 		exit(EXIT_FAILURE);
 	}
 
-	safe_stack.bottom = safe_stack.top = 0x0;
+	ret = large_init(safe_heap.heap, safe_heap.large_addr,
+			 safe_heap.large_size);
+	if (ret == EXIT_FAILURE) {
+		fprintf(stderr, "ERROR: large_init failed, exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (gc_config.blacklist &&
+	    blacklist_init(safe_heap.heap, safe_heap.mmap_addr,
+			   safe_heap.heap_size) == EXIT_FAILURE) {
+		fprintf(stderr, "WARNING: blacklist_init failed, false pointers "
+				"may pin new blocks\n");
+	}
+
+	if (gc_config.quarantine != 0 &&
+	    quarantine_init(safe_heap.pkey, safe_heap.mmap_addr,
+			    safe_heap.heap_size) == EXIT_FAILURE) {
+		fprintf(stderr, "ERROR: quarantine_init failed, exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (gc_config.stats && stats_init() == EXIT_FAILURE) {
+		fprintf(stderr, "WARNING: stats_init failed, gcstat won't see "
+				"this process\n");
+	}
+
+	init_thread = pthread_self();
+	ret = threads_init(safe_heap.pkey);
+	if (ret == EXIT_FAILURE) {
+		fprintf(stderr, "ERROR: threads_init failed, exiting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* spawned while INITIALIZING so that pthread internals use tmp_heap */
+	if (!gc_config.incremental && gc_config.gc_threads > 0) {
+		ret = pool_init(gc_config.gc_threads, gc_thread_init);
+		if (ret == EXIT_FAILURE) {
+			fprintf(stderr, "WARNING: pool_init failed, marking "
+					"on a single thread\n");
+		}
+	}
 
 	tmp_heap = NULL;
 
@@ -104,6 +210,15 @@ __attribute__((destructor)) static void hook_exit(void)
 	 * issues. */
 	pkey_set_perm(safe_heap.pkey, RDWR);
 
+	pool_fini();
+
+	/* whatever this thread still has buffered belongs in the dump */
+	if (thread_self != NULL) {
+		threads_lock();
+		threads_flush(thread_self);
+		threads_unlock();
+	}
+
 #ifdef _BOOKKEEPER_DEBUG
 	bookkeeper_dump();
 #endif
@@ -111,6 +226,10 @@ __attribute__((destructor)) static void hook_exit(void)
 	if (ret == EXIT_FAILURE) {
 		fprintf(stderr, "ERROR: bookkeeper_exit failed\n");
 	}
+	large_fini();
+	blacklist_fini();
+	quarantine_exit();
+	stats_fini();
 
 	ret = destroy_safe_heap(&safe_heap);
 	if (ret == EXIT_FAILURE) {
@@ -118,8 +237,9 @@ __attribute__((destructor)) static void hook_exit(void)
 	}
 }
 
+#ifdef _BOOKKEEPER_DEBUG
 /* initially used asserts for sanity checks, but they use malloc under the
- * hood...
+ * hood... Debug builds only, they cost a RDPKRU per call.
  */
 static void safe_block_sanity_check(void)
 {
@@ -131,7 +251,7 @@ static void safe_block_sanity_check(void)
 		exit(EXIT_FAILURE);
 	}
 
-	if (safe_stack.bottom == 0x0) {
+	if (thread_self == NULL || thread_self->stack.bottom == 0x0) {
 		err_msg =
 		    "ERROR: IN SAFE BLOCK, YET SAFE STACK BOTTOM IS NOT SET\n";
 		write(STDERR_FILENO, err_msg, strlen(err_msg));
@@ -148,6 +268,516 @@ static void unsafe_block_sanity_check(void)
 	write(STDERR_FILENO, err_msg, strlen(err_msg));
 	exit(EXIT_FAILURE);
 }
+#else
+static inline void safe_block_sanity_check(void) {}
+static inline void unsafe_block_sanity_check(void) {}
+#endif
+
+/* brackets a call into the default allocator outside of a safe block */
+static inline void unsafe_call_enter(void)
+{
+	unsafe_block_sanity_check();
+	if (unsafe_needs_perm) {
+		pkey_set_perm(safe_heap.pkey, RDWR);
+		stats_count(&stats->unsafe_toggles);
+	}
+}
+
+static inline void unsafe_call_exit(void)
+{
+	if (unsafe_needs_perm) {
+		pkey_set_perm(safe_heap.pkey, NO_ACCESS);
+	}
+}
+
+/* false for NULL and for blocks of the default allocator */
+static inline bool safe_heap_owns(const void *ptr)
+{
+	return (uintptr_t)ptr - (uintptr_t)safe_heap.mmap_addr <
+	       safe_heap.heap_size;
+}
+
+static void fatal(const char *err_msg)
+{
+	write(STDERR_FILENO, err_msg, strlen(err_msg));
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * the collector scans the safe stack from the hook's frame up to the frame
+ * that entered the safe block.
+ * to get stack addr GNU builtin can be used, however it's not
+ * defined on clang yet... github issue:
+ * https://github.com/llvm/llvm-project/issues/82632
+ * use inline asm as temporary solution
+ */
+static inline void update_safe_stack_top(void)
+{
+	void *stack_top;
+	__asm__("mov %%rsp, %0" : "=r"(stack_top));
+	thread_self->stack.top = (uintptr_t *)PTR_ALIGN_DOWN(stack_top);
+}
+
+/*
+ * stops the other threads in safe blocks and runs the collector over all
+ * their stacks. Lock held.
+ */
+__attribute__((noinline)) static void collect(bool full)
+{
+	/* callee saved registers may hold the only ref to an object, get
+	 * them onto the stack before it is scanned */
+	__builtin_unwind_init();
+	update_safe_stack_top();
+
+	uint64_t start = stats_now();
+	if (threads_stop_world() == EXIT_FAILURE) {
+		fatal("ERROR: threads_stop_world failed\n");
+	}
+	struct stack_region_s *stacks;
+	size_t cnt;
+	if (threads_stacks(&stacks, &cnt) == EXIT_FAILURE) {
+		fatal("ERROR: threads_stacks failed\n");
+	}
+	int ret = full ? bookkeeper_collect_full(stacks, cnt)
+		       : bookkeeper_collect(stacks, cnt);
+	if (ret == EXIT_FAILURE) {
+		fatal("ERROR: bookkeeper_collect failed\n");
+	}
+	if (threads_start_world() == EXIT_FAILURE) {
+		fatal("ERROR: threads_start_world failed\n");
+	}
+	stats_pause(stats_now() - start);
+}
+
+/* lock held */
+static void publish_stats(void)
+{
+	uint64_t enters, exits;
+	threads_safe_blocks(&enters, &exits);
+	stats_write_begin();
+	bookkeeper_stats(stats);
+	stats->safe_enters = enters;
+	stats->safe_exits = exits;
+	stats_write_end();
+}
+
+/*
+ * lock held. The live safe heap is close to its limit: forced full
+ * collection, the bookkeeper raises the limit if that isn't enough. If it
+ * can't, safe allocations follow the oom policy until the pressure is gone.
+ */
+static void relieve_pressure(void)
+{
+	collect(true);
+	__atomic_store_n(&heap_exhausted, bookkeeper_heap_pressure(),
+			 __ATOMIC_RELAXED);
+}
+
+/*
+ * lock held. Whether self should collect its heap, because a sweep or a
+ * purge freed blocks since it last did. Only the owning thread may collect
+ * a mimalloc heap, blocks other threads freed into it wait for that too.
+ */
+static bool trim_due(struct gc_thread_s *self)
+{
+	uint64_t reclaims = bookkeeper_reclaims();
+	if (gc_config.trim == TRIM_NEVER || reclaims == self->trimmed) {
+		return false;
+	}
+	self->trimmed = reclaims;
+	return true;
+}
+
+/* owner only. Hands back the parked blocks whose pages are off the
+ * blacklist now, or all of them when the safe heap needs the room */
+static void unpark(struct gc_thread_s *self, bool all)
+{
+	uint64_t gen = blacklist_generation();
+	if (self->parked_cnt == 0 || (self->parked_gen == gen && !all)) {
+		return;
+	}
+	self->parked_gen = gen;
+	size_t kept = 0;
+	for (size_t i = 0; i < self->parked_cnt; i++) {
+		void *addr = self->parked[i];
+		if (!all && blacklist_hit(addr, mi_usable_size(addr))) {
+			self->parked[kept++] = addr;
+		} else {
+			mi_free(addr);
+		}
+	}
+	self->parked_cnt = kept;
+}
+
+/*
+ * hands the buffered allocations and free requests of this thread to the
+ * bookkeeper, lets an in-progress incremental cycle make progress and
+ * collects when due.
+ */
+static void collector_sync(void)
+{
+	struct gc_thread_s *self = thread_self;
+	threads_lock();
+	if (threads_flush(self) == EXIT_FAILURE) {
+		fatal("ERROR: threads_flush failed\n");
+	}
+	if (__atomic_load_n(&heap_exhausted, __ATOMIC_RELAXED)) {
+		/* backpressure, whatever a marking child finds may make room */
+		bookkeeper_collect_wait();
+	}
+	bool ready;
+	if (bookkeeper_step(self->calls, &ready) == EXIT_FAILURE) {
+		fatal("ERROR: bookkeeper_step failed\n");
+	}
+	self->calls = 0;
+	if (ready || bookkeeper_collection_due()) {
+		collect(false);
+	}
+	if (!bookkeeper_heap_pressure()) {
+		__atomic_store_n(&heap_exhausted, false, __ATOMIC_RELAXED);
+	} else if (!__atomic_load_n(&heap_exhausted, __ATOMIC_RELAXED)) {
+		relieve_pressure();
+	}
+	bool trim = trim_due(self);
+	publish_stats();
+	threads_unlock();
+	unpark(self, __atomic_load_n(&heap_exhausted, __ATOMIC_RELAXED));
+	if (trim) {
+		mi_heap_collect(self->heap, gc_config.trim == TRIM_FORCE);
+		stats_count(&stats->trims);
+	}
+}
+
+/* whether a block allocated right now can't hold pointers, either because
+ * the caller said so or by its size */
+static bool is_noscan(size_t size)
+{
+	return noscan ||
+	       (gc_config.noscan_min != 0 && size >= gc_config.noscan_min);
+}
+
+static size_t safe_usable_size(void *ptr)
+{
+	return large_owns(ptr) ? large_usable_size(ptr) : mi_usable_size(ptr);
+}
+
+/* the lock is only taken once a buffer fills up. Quarantine mode books
+ * nothing, it only notes that the block is allocated */
+static void book_add(void *addr, size_t size, bool noscan)
+{
+	struct gc_thread_s *self = thread_self;
+	PROBE(malloc, addr, size);
+	if (gc_config.quarantine != 0) {
+		quarantine_track(addr);
+		return;
+	}
+	self->calls++;
+	if (safe_heap_owns(addr)) {
+		size_t cnt = self->adds_cnt;
+		self->adds_addr[cnt] = addr;
+		self->adds_size[cnt] = size;
+		self->adds_noscan[cnt] = noscan;
+		/* a collector stopping us only sees complete entries */
+		__atomic_store_n(&self->adds_cnt, cnt + 1, __ATOMIC_RELEASE);
+	}
+	if (self->adds_cnt == THREAD_BUF_LEN ||
+	    (gc_config.incremental && self->calls >= THREAD_BUF_LEN)) {
+		collector_sync();
+	}
+}
+
+/*
+ * quarantine mode: the block is zeroed and queued instead of requested
+ * free. Pointers that aren't the start of an allocated block, double frees
+ * included, are ignored before anything reads the block.
+ */
+static void quarantine_free(void *ptr)
+{
+	struct gc_thread_s *self = thread_self;
+	if (!quarantine_untrack(ptr)) {
+		return;
+	}
+	size_t size = safe_usable_size(ptr);
+	/* whole pages of the large object space are cheaper to drop */
+	if (!large_owns(ptr) || madvise(ptr, size, MADV_DONTNEED) == -1) {
+		memset(ptr, 0, size);
+	}
+
+	struct quarantine_s *q = &self->quarantine;
+	if (quarantine_push(self->heap, q, ptr, size)) {
+		/* no room to grow the ring, empty it instead. Without a ring
+		 * at all the block goes back unprotected */
+		quarantine_release(q, 0);
+		if (quarantine_push(self->heap, q, ptr, size)) {
+			if (large_owns(ptr)) {
+				large_free(ptr);
+			} else {
+				mi_free(ptr);
+			}
+			return;
+		}
+	}
+	stats_count(&stats->quarantined);
+	size_t released = quarantine_release(q, gc_config.quarantine);
+	if (released != 0) {
+		__atomic_fetch_add(&stats->quarantine_releases, released,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+/* the booked size and noscan bit of addr, from our own unflushed adds or
+ * the book. false if addr is unknown */
+static bool book_lookup(void *addr, size_t *size, bool *noscan)
+{
+	struct gc_thread_s *self = thread_self;
+	bool found = false;
+	if (gc_config.quarantine != 0) {
+		/* nothing is booked, an allocated block is all usable */
+		if (!quarantine_live(addr)) {
+			return false;
+		}
+		*size = safe_usable_size(addr);
+		*noscan = false;
+		return true;
+	}
+
+	threads_lock();
+	/* the newest add wins, the address may have been freed and reused */
+	for (size_t i = self->adds_cnt; i > self->adds_flushed; i--) {
+		if (self->adds_addr[i - 1] == addr) {
+			*size = self->adds_size[i - 1];
+			*noscan = self->adds_noscan[i - 1];
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+		found = bookkeeper_lookup(addr, size, noscan);
+	}
+	threads_unlock();
+	return found;
+}
+
+static void book_free(void *ptr)
+{
+	struct gc_thread_s *self = thread_self;
+	if (PROBE_ENABLED(free)) {
+		/* ptr comes from the program, only trust what was booked */
+		size_t size = 0;
+		bool noscan_bit;
+		book_lookup(ptr, &size, &noscan_bit);
+		PROBE(free, ptr, size);
+	}
+	if (gc_config.quarantine != 0) {
+		quarantine_free(ptr);
+		return;
+	}
+	self->calls++;
+	if (ptr != NULL) {
+		size_t cnt = self->frees_cnt;
+		self->frees[cnt] = ptr;
+		__atomic_store_n(&self->frees_cnt, cnt + 1, __ATOMIC_RELEASE);
+	}
+	/* a buffer full of large blocks is too many bytes to sit on */
+	if (self->frees_cnt == THREAD_BUF_LEN || large_owns(ptr) ||
+	    (gc_config.incremental && self->calls >= THREAD_BUF_LEN)) {
+		collector_sync();
+	}
+}
+
+/* align is 0 for mimalloc's default alignment, else a power of two */
+static void *mimalloc_alloc(size_t size, size_t align, bool zero)
+{
+	if (align != 0) {
+		return zero ? mi_heap_zalloc_aligned(thread_self->heap, size,
+						     align)
+			    : mi_heap_malloc_aligned(thread_self->heap, size,
+						     align);
+	}
+	if (zero) {
+		return mi_heap_zalloc(thread_self->heap, size);
+	}
+	return mi_heap_malloc(thread_self->heap, size);
+}
+
+/* blocks of at least large_min bytes get pages of their own, mimalloc takes
+ * them once the large object space is full. Blocks too big for the book
+ * only fit the large object space. The large object space keeps clear of
+ * blacklisted pages itself */
+static void *heap_alloc(size_t size, size_t align, bool zero)
+{
+	bool large = (gc_config.large_min != 0 && size >= gc_config.large_min) ||
+		     size > BOOK_MAX_SIZE;
+	if (large && align <= LARGE_PAGE_SIZE) {
+		/* fresh or dropped pages, already zero */
+		void *addr = large_alloc(size);
+		if (addr != NULL) {
+			return addr;
+		}
+	}
+	if (size > BOOK_MAX_SIZE) {
+		return NULL;
+	}
+	void *addr = mimalloc_alloc(size, align, zero);
+	struct gc_thread_s *self = thread_self;
+	while (addr != NULL && blacklist_hit(addr, size) &&
+	       self->parked_cnt < THREAD_PARK_LEN &&
+	       !__atomic_load_n(&heap_exhausted, __ATOMIC_RELAXED)) {
+		/* a false pointer already points into it, once handed out
+		 * it would never be reclaimed. Keep it and take another */
+		self->parked[self->parked_cnt++] = addr;
+		stats_count(&stats->parked);
+		addr = mimalloc_alloc(size, align, zero);
+	}
+	return addr;
+}
+
+/* the safe heap is full, even after a forced full collection */
+static void *exhausted_alloc(size_t size, size_t align, bool zero)
+{
+	void *addr;
+	switch (gc_config.oom) {
+	case OOM_ABORT:
+		fatal("ERROR: SAFE HEAP EXHAUSTED\n");
+		break;
+	case OOM_UNSAFE:
+		/* never booked, free hands it back to the default allocator */
+		if (align == 0) {
+			return zero ? _calloc(1, size) : _malloc(size);
+		}
+		if (_posix_memalign(&addr, align, size) != 0) {
+			return NULL;
+		}
+		if (zero) {
+			memset(addr, 0, size);
+		}
+		return addr;
+	case OOM_FAIL:
+		break;
+	}
+	errno = ENOMEM;
+	return NULL;
+}
+
+static void *safe_alloc_zero(size_t nmemb, size_t size, size_t align,
+			     bool zero)
+{
+	size_t bsize;
+	if (__builtin_mul_overflow(nmemb, size, &bsize) ||
+	    (bsize > BOOK_MAX_SIZE && bsize > gc_config.large_space)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (__atomic_load_n(&heap_exhausted, __ATOMIC_RELAXED)) {
+		/* a lazy sweep or a marking child may have made room since */
+		collector_sync();
+		if (__atomic_load_n(&heap_exhausted, __ATOMIC_RELAXED)) {
+			return exhausted_alloc(bsize, align, zero);
+		}
+	}
+
+	void *addr = heap_alloc(bsize, align, zero);
+	if (addr == NULL && gc_config.quarantine != 0) {
+		/* nothing is traced, only the quarantine can make room */
+		quarantine_release(&thread_self->quarantine, 0);
+		addr = heap_alloc(bsize, align, zero);
+	} else if (addr == NULL) {
+		/* mimalloc ran out before the limit was reached, whatever a
+		 * full collection frees may be enough */
+		threads_lock();
+		if (threads_flush(thread_self) == EXIT_FAILURE) {
+			fatal("ERROR: threads_flush failed\n");
+		}
+		relieve_pressure();
+		threads_unlock();
+		unpark(thread_self, true);
+		addr = heap_alloc(bsize, align, zero);
+	}
+	return addr != NULL ? addr : exhausted_alloc(bsize, align, zero);
+}
+
+static void *safe_alloc(size_t size)
+{
+	return safe_alloc_zero(1, size, 0, false);
+}
+
+static void *safe_calloc(size_t nmemb, size_t size)
+{
+	return safe_alloc_zero(nmemb, size, 0, true);
+}
+
+/* every booked block starts on a granule, smaller alignments are free */
+static void *safe_memalign(size_t align, size_t size)
+{
+	if (align < BOOK_GRANULE) {
+		align = BOOK_GRANULE;
+	}
+	void *addr = safe_alloc_zero(1, size, align, false);
+	book_add(addr, size, is_noscan(size));
+	return addr;
+}
+
+/* grows or shrinks ptr where it is, large blocks only within their pages */
+static bool safe_expand(void *ptr, size_t size)
+{
+	if (large_owns(ptr)) {
+		return size <= large_usable_size(ptr);
+	}
+	/* the book holds no more of a mimalloc block */
+	return size <= BOOK_MAX_SIZE && mi_expand(ptr, size) != NULL;
+}
+
+/*
+ * keeps the block when it still fits. Its entry is left alone, the book
+ * holds the usable size and a block that fits in place doesn't change it.
+ * A block that has to move is copied, and the old one becomes a free request
+ * like any other: refs to it may still be around.
+ */
+static void *safe_realloc(void *ptr, size_t size)
+{
+	/* in quarantine mode a block that isn't allocated may be back in
+	 * mimalloc, it is treated like NULL */
+	if (gc_config.quarantine != 0 && !quarantine_live(ptr)) {
+		ptr = NULL;
+	}
+	if (ptr != NULL && safe_expand(ptr, size)) {
+		return ptr;
+	}
+
+	void *addr = safe_alloc(size);
+	if (addr == NULL) {
+		/* the old block is left alone, see `man 3 realloc` */
+		return NULL;
+	}
+	bool noscan_bit = is_noscan(size);
+	if (ptr != NULL) {
+		size_t old_size = safe_usable_size(ptr);
+		memcpy(addr, ptr, old_size < size ? old_size : size);
+		/* the contents move, whether they hold pointers doesn't change */
+		size_t booked;
+		book_lookup(ptr, &booked, &noscan_bit);
+	}
+	book_add(addr, size, noscan_bit);
+	book_free(ptr);
+	return addr;
+}
+
+/* every thread allocates from its own heap in the safe arena, the thread
+ * that ran hook_init keeps the one created with the arena */
+static void register_thread(void)
+{
+	mi_heap_t *heap = safe_heap.heap;
+	if (!pthread_equal(pthread_self(), init_thread)) {
+		heap = mi_heap_new_in_arena(safe_heap.arena);
+		if (heap == NULL) {
+			fatal("ERROR: mi_heap_new_in_arena failed\n");
+		}
+	}
+	bookkeeper_thread_init(heap);
+	if (threads_register(heap) == NULL) {
+		fatal("ERROR: threads_register failed\n");
+	}
+}
 
 /* need to be given frame address of caller,
  * using __builtin_frame_address(unsigned int level) with non-zero level
@@ -155,19 +785,43 @@ static void unsafe_block_sanity_check(void)
  * */
 void enter_safe_block(void *stack_bottom)
 {
+	pkey_set_perm(safe_heap.pkey, RDWR);
+	if (thread_self == NULL) {
+		register_thread();
+	}
+
+	/* a collection running right now must not see half a safe block */
+	threads_lock();
 	/* prefer aligning up, feeling more conservative I guess...
 	 * I could perhaps add `padding` to ensure more we're scanning all
 	 * that we should.
 	 */
-	safe_stack.bottom = (uintptr_t *)PTR_ALIGN_UP(stack_bottom);
+	thread_self->stack.bottom = (uintptr_t *)PTR_ALIGN_UP(stack_bottom);
+	thread_self->in_safe_block = true;
+	thread_self->enters++;
+	threads_unlock();
 	in_safe_block = true;
-	pkey_set_perm(safe_heap.pkey, RDWR);
+	PROBE(enter_safe_block, stack_bottom);
 }
 
 void exit_safe_block(void)
 {
-	safe_stack.top = 0x0;
-	safe_stack.bottom = 0x0;
+	if (thread_self == NULL) {
+		/* never entered one */
+		in_safe_block = false;
+		pkey_set_perm(safe_heap.pkey, NO_ACCESS);
+		return;
+	}
+	threads_lock();
+	if (threads_flush(thread_self) == EXIT_FAILURE) {
+		fatal("ERROR: threads_flush failed\n");
+	}
+	PROBE(exit_safe_block, thread_self->stack.bottom);
+	thread_self->stack.top = 0x0;
+	thread_self->stack.bottom = 0x0;
+	thread_self->in_safe_block = false;
+	thread_self->exits++;
+	threads_unlock();
 	in_safe_block = false;
 	pkey_set_perm(safe_heap.pkey, NO_ACCESS);
 }
@@ -194,6 +848,51 @@ void unset_exempt(void)
 	exempt = false;
 }
 
+void set_noscan(void)
+{
+	if (!in_safe_block) {
+		char *err_msg =
+		    "ERROR: CALLING NOSCAN IN UNSAFE BLOCK NOT ALLOWED";
+		write(STDERR_FILENO, err_msg, strlen(err_msg));
+		exit(EXIT_FAILURE);
+	}
+	noscan = true;
+}
+
+void unset_noscan(void)
+{
+	if (!in_safe_block) {
+		char *err_msg =
+		    "ERROR: CALLING NOSCAN IN UNSAFE BLOCK NOT ALLOWED";
+		write(STDERR_FILENO, err_msg, strlen(err_msg));
+		exit(EXIT_FAILURE);
+	}
+	noscan = false;
+}
+
+/* pointer-free blocks, outside of a safe block these are plain allocations */
+void *malloc_noscan(size_t size)
+{
+	if (!in_safe_block || exempt) {
+		return malloc(size);
+	}
+	safe_block_sanity_check();
+	void *addr = safe_alloc(size);
+	book_add(addr, size, true);
+	return addr;
+}
+
+void *calloc_noscan(size_t nmemb, size_t size)
+{
+	if (!in_safe_block || exempt) {
+		return calloc(nmemb, size);
+	}
+	safe_block_sanity_check();
+	void *addr = safe_calloc(nmemb, size);
+	book_add(addr, nmemb * size, true);
+	return addr;
+}
+
 void purge_safe_block(void)
 {
 	if (!in_safe_block) {
@@ -202,7 +901,50 @@ void purge_safe_block(void)
 		write(STDERR_FILENO, err_msg, strlen(err_msg));
 		exit(EXIT_FAILURE);
 	}
+	threads_lock();
+	if (threads_flush(thread_self) == EXIT_FAILURE) {
+		fatal("ERROR: threads_flush failed\n");
+	}
 	bookkeeper_purge_all();
+	if (gc_config.quarantine != 0) {
+		/* nothing is booked, the live bitmap has every allocated block.
+		 * The ones freed already wait in the queues, ours goes too */
+		quarantine_purge();
+		quarantine_release(&thread_self->quarantine, 0);
+	}
+	bool trim = trim_due(thread_self);
+	publish_stats();
+	threads_unlock();
+	if (trim) {
+		/* everything is gone, no point in keeping pages around */
+		mi_heap_collect(thread_self->heap, true);
+		stats_count(&stats->trims);
+	}
+}
+
+/* hands the empty pages of this thread's safe heap back to the OS now,
+ * e.g. once a server goes idle. Callable outside of safe blocks */
+void trim_safe_heap(void)
+{
+	struct gc_thread_s *self = thread_self;
+	if (self == NULL) {
+		/* never entered a safe block, there is no heap */
+		return;
+	}
+	if (!in_safe_block) {
+		pkey_set_perm(safe_heap.pkey, RDWR);
+	}
+	threads_lock();
+	if (threads_flush(self) == EXIT_FAILURE) {
+		fatal("ERROR: threads_flush failed\n");
+	}
+	self->trimmed = bookkeeper_reclaims();
+	threads_unlock();
+	mi_heap_collect(self->heap, true);
+	stats_count(&stats->trims);
+	if (!in_safe_block) {
+		pkey_set_perm(safe_heap.pkey, NO_ACCESS);
+	}
 }
 
 void *malloc(size_t size)
@@ -217,20 +959,13 @@ void *malloc(size_t size)
 			/* user requsted for allocs to bypass safe heap */
 			return _malloc(size);
 		}
-		void *addr = mi_heap_malloc(safe_heap.heap, size);
-		if (bookkeeper_add(addr, size) == EXIT_FAILURE) {
-			// should not continue...
-			char *err_msg =
-			    "ERROR: malloc: bookkeeper_add failed\n";
-			write(STDERR_FILENO, err_msg, strlen(err_msg));
-			exit(EXIT_FAILURE);
-		}
+		void *addr = safe_alloc(size);
+		book_add(addr, size, is_noscan(size));
 		return addr;
 	}
-	unsafe_block_sanity_check();
-	pkey_set_perm(safe_heap.pkey, RDWR);
+	unsafe_call_enter();
 	void *addr = _malloc(size);
-	pkey_set_perm(safe_heap.pkey, NO_ACCESS);
+	unsafe_call_exit();
 	return addr;
 }
 
@@ -246,21 +981,14 @@ void *calloc(size_t nmemb, size_t size)
 			/* user requsted for allocs to  bypass safe heap */
 			return _calloc(nmemb, size);
 		}
-		void *addr = mi_heap_calloc(safe_heap.heap, nmemb, size);
+		void *addr = safe_calloc(nmemb, size);
 		size_t bsize = nmemb * size; // size in bytes
-		if (bookkeeper_add(addr, bsize) == EXIT_FAILURE) {
-			// should not continue...
-			char *err_msg =
-			    "ERROR: calloc: bookkeeper_add failed\n";
-			write(STDERR_FILENO, err_msg, strlen(err_msg));
-			exit(EXIT_FAILURE);
-		}
+		book_add(addr, bsize, is_noscan(bsize));
 		return addr;
 	}
-	unsafe_block_sanity_check();
-	pkey_set_perm(safe_heap.pkey, RDWR);
+	unsafe_call_enter();
 	void *addr = _calloc(nmemb, size);
-	pkey_set_perm(safe_heap.pkey, NO_ACCESS);
+	unsafe_call_exit();
 	return addr;
 }
 
@@ -272,26 +1000,16 @@ void *realloc(void *_Nullable ptr, size_t size)
 
 	if (in_safe_block) {
 		safe_block_sanity_check();
-		if (exempt) {
-			/* user requsted for allocs to  bypass safe heap */
+		/* user requsted for allocs to bypass safe heap, or the block
+		 * is from the default allocator anyway */
+		if (exempt || (ptr != NULL && !safe_heap_owns(ptr))) {
 			return _realloc(ptr, size);
 		}
-		/* there is a bug here. The old address needs to be removed
-		 * from the bookkeeper. */
-		void *addr = mi_heap_realloc(safe_heap.heap, ptr, size);
-		if (bookkeeper_add(addr, size) == EXIT_FAILURE) {
-			// should not continue...
-			char *err_msg =
-			    "ERROR: realloc: bookkeeper_add failed\n";
-			write(STDERR_FILENO, err_msg, strlen(err_msg));
-			exit(EXIT_FAILURE);
-		}
-		return addr;
+		return safe_realloc(ptr, size);
 	}
-	unsafe_block_sanity_check();
-	pkey_set_perm(safe_heap.pkey, RDWR);
+	unsafe_call_enter();
 	void *addr = _realloc(ptr, size);
-	pkey_set_perm(safe_heap.pkey, NO_ACCESS);
+	unsafe_call_exit();
 	return addr;
 }
 
@@ -304,25 +1022,210 @@ void free(void *_Nullable ptr)
 
 	if (in_safe_block) {
 		safe_block_sanity_check();
-		if (exempt) {
-			/* user requsted for allocs to  bypass safe heap */
+		/* user requsted for allocs to bypass safe heap, or the block
+		 * is from the default allocator anyway */
+		if (exempt || (ptr != NULL && !safe_heap_owns(ptr))) {
 			_free(ptr);
 			return;
 		}
-		/* to get stack addr GNU builtin can be used, however it's not
-		 * defined on clang yet... github issue:
-		 * https://github.com/llvm/llvm-project/issues/82632
-		 * use inline asm as temporary solution
-		 */
-		void *stack_top;
-		__asm__("mov %%rsp, %0" : "=r"(stack_top));
-		safe_stack.top = (uintptr_t *)PTR_ALIGN_DOWN(stack_top);
-		bookkeeper_request_free(ptr, &safe_stack);
+		book_free(ptr);
 		return;
 	}
 
-	unsafe_block_sanity_check();
-	pkey_set_perm(safe_heap.pkey, RDWR);
+	unsafe_call_enter();
 	_free(ptr);
-	pkey_set_perm(safe_heap.pkey, NO_ACCESS);
+	unsafe_call_exit();
+}
+
+static inline bool is_pow2(size_t x)
+{
+	return x != 0 && (x & (x - 1)) == 0;
+}
+
+/* glibc rounds a bad alignment up to the next power of two */
+static size_t memalign_align(size_t align)
+{
+	if (align == 0) {
+		return 1;
+	}
+	if (is_pow2(align)) {
+		return align;
+	}
+	if (align > SIZE_MAX / 2 + 1) {
+		return 0;
+	}
+	return 1UL << (64 - __builtin_clzl(align));
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (INITIALIZING) {
+		*memptr = mi_heap_malloc_aligned(tmp_heap, size, alignment);
+		return *memptr != NULL ? 0 : ENOMEM;
+	}
+
+	if (in_safe_block) {
+		safe_block_sanity_check();
+		if (exempt) {
+			return _posix_memalign(memptr, alignment, size);
+		}
+		if (!is_pow2(alignment) || alignment % sizeof(void *) != 0) {
+			return EINVAL;
+		}
+		/* errno is left alone, the error is the return value */
+		int saved_errno = errno;
+		void *addr = safe_memalign(alignment, size);
+		errno = saved_errno;
+		if (addr == NULL) {
+			return ENOMEM;
+		}
+		*memptr = addr;
+		return 0;
+	}
+	unsafe_call_enter();
+	int ret = _posix_memalign(memptr, alignment, size);
+	unsafe_call_exit();
+	return ret;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	if (INITIALIZING) {
+		return mi_heap_malloc_aligned(tmp_heap, size, alignment);
+	}
+
+	if (in_safe_block) {
+		safe_block_sanity_check();
+		if (exempt) {
+			return _aligned_alloc(alignment, size);
+		}
+		if (!is_pow2(alignment)) {
+			errno = EINVAL;
+			return NULL;
+		}
+		return safe_memalign(alignment, size);
+	}
+	unsafe_call_enter();
+	void *addr = _aligned_alloc(alignment, size);
+	unsafe_call_exit();
+	return addr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	if (INITIALIZING) {
+		return mi_heap_malloc_aligned(tmp_heap, size,
+					      memalign_align(alignment));
+	}
+
+	if (in_safe_block) {
+		safe_block_sanity_check();
+		if (exempt) {
+			return _memalign(alignment, size);
+		}
+		alignment = memalign_align(alignment);
+		if (alignment == 0) {
+			errno = EINVAL;
+			return NULL;
+		}
+		return safe_memalign(alignment, size);
+	}
+	unsafe_call_enter();
+	void *addr = _memalign(alignment, size);
+	unsafe_call_exit();
+	return addr;
+}
+
+void *valloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (INITIALIZING) {
+		return mi_heap_malloc_aligned(tmp_heap, size, page);
+	}
+
+	if (in_safe_block) {
+		safe_block_sanity_check();
+		if (exempt) {
+			return _valloc(size);
+		}
+		return safe_memalign(page, size);
+	}
+	unsafe_call_enter();
+	void *addr = _valloc(size);
+	unsafe_call_exit();
+	return addr;
+}
+
+/* valloc, with the size rounded up to whole pages */
+void *pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t rounded = size == 0 ? page : __builtin_align_up(size, page);
+	if (INITIALIZING) {
+		return mi_heap_malloc_aligned(tmp_heap, rounded, page);
+	}
+
+	if (in_safe_block) {
+		safe_block_sanity_check();
+		if (exempt) {
+			return _pvalloc(size);
+		}
+		if (rounded < size) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		return safe_memalign(page, rounded);
+	}
+	unsafe_call_enter();
+	void *addr = _pvalloc(size);
+	unsafe_call_exit();
+	return addr;
+}
+
+void *reallocarray(void *_Nullable ptr, size_t nmemb, size_t size)
+{
+	if (INITIALIZING || in_safe_block) {
+		size_t bsize;
+		if (__builtin_mul_overflow(nmemb, size, &bsize)) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		/* realloc knows what to do with the block */
+		return realloc(ptr, bsize);
+	}
+	unsafe_call_enter();
+	void *addr = _reallocarray(ptr, nmemb, size);
+	unsafe_call_exit();
+	return addr;
+}
+
+/*
+ * answered by mimalloc (or the large space) for safe blocks, without
+ * touching the book. Entries already cover the whole usable size, so
+ * pointers stored past the requested size are still found by the collector.
+ */
+size_t malloc_usable_size(void *_Nullable ptr)
+{
+	if (INITIALIZING) {
+		return mi_usable_size(ptr);
+	}
+
+	if (!safe_heap_owns(ptr)) {
+		if (in_safe_block) {
+			return _malloc_usable_size(ptr);
+		}
+		unsafe_call_enter();
+		size_t size = _malloc_usable_size(ptr);
+		unsafe_call_exit();
+		return size;
+	}
+	if (!in_safe_block) {
+		/* mimalloc's page info is in the safe heap */
+		pkey_set_perm(safe_heap.pkey, RDWR);
+		size_t size = safe_usable_size(ptr);
+		pkey_set_perm(safe_heap.pkey, NO_ACCESS);
+		return size;
+	}
+	safe_block_sanity_check();
+	return safe_usable_size(ptr);
 }
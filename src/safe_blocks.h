@@ -3,6 +3,7 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 /* all symbols are weak so that compiler doesn't NEED to resolve their
  * definition during link time. This makes it very easy to include in other
@@ -15,6 +16,11 @@ __attribute__((weak)) void exit_safe_block(void);
 __attribute__((weak)) void purge_safe_block(void);
 __attribute__((weak)) void set_exempt(void);
 __attribute__((weak)) void unset_exempt(void);
+__attribute__((weak)) void set_noscan(void);
+__attribute__((weak)) void unset_noscan(void);
+__attribute__((weak)) void *malloc_noscan(size_t size);
+__attribute__((weak)) void *calloc_noscan(size_t nmemb, size_t size);
+__attribute__((weak)) void trim_safe_heap(void);
 
 #define ENTER_SAFE_BLOCK                                                       \
 	do {                                                                   \
@@ -50,4 +56,32 @@ __attribute__((weak)) void unset_exempt(void);
 		}                                                              \
 	} while (0)
 
+/* gives the thread's free safe heap pages back to the OS */
+#define TRIM_SAFE_HEAP                                                         \
+	do {                                                                   \
+		if (trim_safe_heap) {                                          \
+			trim_safe_heap();                                      \
+		}                                                              \
+	} while (0)
+
+/* for buffers that never hold pointers (strings, raw input...). They are
+ * still protected from UAF, but the collector doesn't scan them */
+#define MALLOC_NOSCAN(size) (malloc_noscan ? malloc_noscan(size) : malloc(size))
+
+#define CALLOC_NOSCAN(nmemb, size)                                             \
+	(calloc_noscan ? calloc_noscan(nmemb, size) : calloc(nmemb, size))
+
+/* every allocation made by foo is pointer-free, for call sites we can't
+ * change. Only valid inside a safe block */
+#define NOSCAN(foo)                                                            \
+	do {                                                                   \
+		if (set_noscan) {                                              \
+			set_noscan();                                          \
+		}                                                              \
+		foo;                                                           \
+		if (unset_noscan) {                                            \
+			unset_noscan();                                        \
+		}                                                              \
+	} while (0)
+
 #endif
@@ -0,0 +1,103 @@
+#include "scan.h"
+#include <immintrin.h>
+#include <stdbool.h>
+
+typedef uintptr_t *(*scan_fn_t)(uintptr_t *, uintptr_t *, uintptr_t,
+				uintptr_t);
+
+/* a word is a candidate iff (word - base) <= span, unsigned */
+static inline bool in_range(uintptr_t word, uintptr_t base, uintptr_t span)
+{
+	return word - base <= span;
+}
+
+static uintptr_t *scan_scalar(uintptr_t *cur, uintptr_t *end, uintptr_t base,
+			      uintptr_t span)
+{
+	for (; cur < end; cur++) {
+		if (in_range(*cur, base, span)) {
+			return cur;
+		}
+	}
+	return end;
+}
+
+/*
+ * AVX2 has no unsigned 64-bit compare, so both sides get their sign bit
+ * flipped and the signed one is used. 8 words are tested per iteration,
+ * the 4-word halves are only looked at once one of them has a candidate.
+ */
+__attribute__((target("avx2"))) static uintptr_t *
+scan_avx2(uintptr_t *cur, uintptr_t *end, uintptr_t base, uintptr_t span)
+{
+	const __m256i sign = _mm256_set1_epi64x((long long)(1ULL << 63));
+	const __m256i vbase = _mm256_set1_epi64x((long long)base);
+	const __m256i vspan = _mm256_set1_epi64x((long long)(span ^ (1ULL << 63)));
+
+	for (; end - cur >= 8; cur += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)cur);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(cur + 4));
+		a = _mm256_xor_si256(_mm256_sub_epi64(a, vbase), sign);
+		b = _mm256_xor_si256(_mm256_sub_epi64(b, vbase), sign);
+		/* all ones where the word is out of range */
+		__m256i oa = _mm256_cmpgt_epi64(a, vspan);
+		__m256i ob = _mm256_cmpgt_epi64(b, vspan);
+		unsigned m = (unsigned)_mm256_movemask_pd(
+				     _mm256_castsi256_pd(oa)) |
+			     (unsigned)_mm256_movemask_pd(
+				     _mm256_castsi256_pd(ob)) << 4;
+		if (m != 0xff) {
+			return cur + __builtin_ctz(~m);
+		}
+	}
+	return scan_scalar(cur, end, base, span);
+}
+
+__attribute__((target("avx512f"))) static uintptr_t *
+scan_avx512(uintptr_t *cur, uintptr_t *end, uintptr_t base, uintptr_t span)
+{
+	const __m512i vbase = _mm512_set1_epi64((long long)base);
+	const __m512i vspan = _mm512_set1_epi64((long long)span);
+
+	for (; end - cur >= 16; cur += 16) {
+		__m512i a = _mm512_loadu_si512((const void *)cur);
+		__m512i b = _mm512_loadu_si512((const void *)(cur + 8));
+		__mmask8 ma = _mm512_cmple_epu64_mask(
+			_mm512_sub_epi64(a, vbase), vspan);
+		__mmask8 mb = _mm512_cmple_epu64_mask(
+			_mm512_sub_epi64(b, vbase), vspan);
+		unsigned m = (unsigned)ma | (unsigned)mb << 8;
+		if (m != 0) {
+			return cur + __builtin_ctz(m);
+		}
+	}
+	return scan_scalar(cur, end, base, span);
+}
+
+static scan_fn_t scan_fn = scan_scalar;
+static const char *scan_name = "scalar";
+
+/* must run before any scan, the markers only read scan_fn afterwards */
+void scan_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		scan_fn = scan_avx512;
+		scan_name = "avx512";
+	} else if (__builtin_cpu_supports("avx2")) {
+		scan_fn = scan_avx2;
+		scan_name = "avx2";
+	}
+}
+
+const char *scan_kernel(void)
+{
+	return scan_name;
+}
+
+/* returns the first candidate word in [cur, end), or end if there is none */
+uintptr_t *scan_next(uintptr_t *cur, uintptr_t *end, uintptr_t base,
+		     uintptr_t span)
+{
+	return scan_fn(cur, end, base, span);
+}
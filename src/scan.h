@@ -0,0 +1,17 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/*
+ * CONSERVATIVE SCAN FILTER. FINDS THE NEXT WORD OF A REGION THAT FALLS IN
+ * [base, base + span]. AVX2/AVX-512 KERNELS ARE PICKED AT RUNTIME, THE
+ * SCALAR LOOP IS KEPT FOR EVERYTHING ELSE.
+ */
+
+#include <stdint.h>
+
+void scan_init(void);
+const char *scan_kernel(void);
+uintptr_t *scan_next(uintptr_t *cur, uintptr_t *end, uintptr_t base,
+		     uintptr_t span);
+
+#endif
@@ -2,7 +2,13 @@
 #include <stdio.h>
 #include <sys/mman.h>
 
-int create_safe_heap(struct safe_heap_s *safe_heap)
+/*
+ * size is only address space, MAP_NORESERVE keeps it from counting against
+ * overcommit. mimalloc commits what it uses, large.c what it hands out from
+ * the last large_size bytes.
+ */
+int create_safe_heap(struct safe_heap_s *safe_heap, size_t size,
+		     size_t large_size, void *hint)
 {
 	assert(safe_heap != NULL && "create_safe_heap: given NULL safe_heap");
 	int pkey = pkey_alloc(0, 0);
@@ -11,16 +17,14 @@ int create_safe_heap(struct safe_heap_s *safe_heap)
 		return EXIT_FAILURE;
 	}
 
-	void *hint = (void *)0x300000000000;
-	void *addr = mmap(hint, SAFE_HEAP_SIZE, PROT_WRITE | PROT_READ,
-			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	void *addr = mmap(hint, size, PROT_WRITE | PROT_READ,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 	if (addr == MAP_FAILED) {
 		perror("create_safe_heap: mmap");
 		goto cleanup_pkey;
 	}
 
-	if (pkey_mprotect(addr, SAFE_HEAP_SIZE, PROT_WRITE | PROT_READ, pkey) ==
-	    -1) {
+	if (pkey_mprotect(addr, size, PROT_WRITE | PROT_READ, pkey) == -1) {
 		perror("create_safe_heap: pkey_mprotect");
 		goto cleanup;
 	}
@@ -28,8 +32,8 @@ int create_safe_heap(struct safe_heap_s *safe_heap)
 	// found through github that they need 4MiB alignment, perhaps look
 	// again later though from my expirements it's 32MB...
 	mi_arena_id_t mi_id;
-	if (!mi_manage_os_memory_ex(addr, SAFE_HEAP_SIZE, false, false, true,
-				    -1, true, &mi_id)) {
+	if (!mi_manage_os_memory_ex(addr, size - large_size, false, false,
+				    true, -1, true, &mi_id)) {
 		fprintf(stderr, "create_safe_heap: mi_manage_os_memory_ex\n");
 		goto cleanup;
 	}
@@ -40,13 +44,16 @@ int create_safe_heap(struct safe_heap_s *safe_heap)
 		goto cleanup;
 	}
 	safe_heap->heap = heap;
-	safe_heap->heap_size = SAFE_HEAP_SIZE;
+	safe_heap->arena = mi_id;
+	safe_heap->heap_size = size;
 	safe_heap->pkey = pkey;
 	safe_heap->mmap_addr = addr;
+	safe_heap->large_addr = (char *)addr + size - large_size;
+	safe_heap->large_size = large_size;
 	return EXIT_SUCCESS;
 
 cleanup:
-	if (munmap(addr, SAFE_HEAP_SIZE) == -1) {
+	if (munmap(addr, size) == -1) {
 		perror("create_safe_heap: munmap");
 	}
 cleanup_pkey:
@@ -64,7 +71,7 @@ int destroy_safe_heap(struct safe_heap_s *safe_heap)
 	assert(safe_heap->heap != NULL &&
 	       "destroy_safe_heap: tried to free NULL safe_heap");
 	mi_heap_delete(safe_heap->heap);
-	if (munmap(safe_heap->mmap_addr, SAFE_HEAP_SIZE) != 0) {
+	if (munmap(safe_heap->mmap_addr, safe_heap->heap_size) != 0) {
 		perror("destroy_safe_heap: munmap");
 		return EXIT_FAILURE;
 	}
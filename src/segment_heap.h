@@ -8,13 +8,14 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 
-#define SAFE_HEAP_SIZE (1024UL * 1024 * 1024) * 4 // 1GiB * 4
-
 struct safe_heap_s {
 	void *mmap_addr;
         size_t heap_size;
 	int pkey;
 	mi_heap_t *heap;
+	mi_arena_id_t arena; /* for the heaps of the other threads */
+	void *large_addr;    /* large_size bytes after the arena */
+	size_t large_size;
 };
 
 // each pkey_perm has two bits, (WD, AD)
@@ -31,7 +32,8 @@ enum PKEY_PERM {
 	NO_ACCESS = PKEY_DISABLE_ACCESS,
 };
 
-int create_safe_heap(struct safe_heap_s *safe_heap);
+int create_safe_heap(struct safe_heap_s *safe_heap, size_t size,
+		     size_t large_size, void *hint);
 int destroy_safe_heap(struct safe_heap_s *safe_heap);
 enum PKEY_PERM pkey_get_perm(int pkey);
 void pkey_set_perm(int pkey, enum PKEY_PERM perm);
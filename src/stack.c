@@ -3,7 +3,7 @@
 int stack_init(mi_heap_t *heap, struct stack_s *s)
 {
 	s->stack = mi_heap_malloc(heap, INIT_LEN * sizeof(void *));
-	if (s == NULL) {
+	if (s->stack == NULL) {
 		perror("stack_init: mi_heap_malloc");
 		return EXIT_FAILURE;
 	}
@@ -21,6 +21,9 @@ void stack_fini(struct stack_s *s)
 int stack_push(mi_heap_t *heap, struct stack_s *s, void *val)
 {
 	if (s->top + 1 == s->size) {
+		if (heap == NULL) {
+			return EXIT_FAILURE;
+		}
 		size_t newsize = 2 * s->size * sizeof(void *);
 		void **tmp = mi_heap_realloc(heap, s->stack, newsize);
 		if (tmp == NULL) {
@@ -39,6 +42,16 @@ bool stack_is_empty(struct stack_s *s)
 	return s->top <= -1;
 }
 
+size_t stack_len(struct stack_s *s)
+{
+	return s->top + 1;
+}
+
+void stack_clear(struct stack_s *s)
+{
+	s->top = -1;
+}
+
 void stack_pop(struct stack_s *s, void **retval)
 {
 	/* will not check if stack is not empty */
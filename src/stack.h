@@ -18,8 +18,11 @@ struct stack_s {
 };
 
 int stack_init(mi_heap_t *heap, struct stack_s *s);
+/* a NULL heap never grows the stack, pushing onto a full one fails */
 int stack_push(mi_heap_t *heap, struct stack_s *s, void *val);
 bool stack_is_empty(struct stack_s *s);
+size_t stack_len(struct stack_s *s);
+void stack_clear(struct stack_s *s);
 void stack_pop(struct stack_s *s, void **retval);
 void stack_fini(struct stack_s *s);
 
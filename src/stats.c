@@ -0,0 +1,122 @@
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct gc_stats_s private_stats;
+struct gc_stats_s *stats = &private_stats;
+static char shm_name[32];
+
+/* a forked child would keep writing into the parent's page */
+static void stats_atfork_child(void)
+{
+	private_stats = *stats;
+	stats = &private_stats;
+}
+
+static int create_segment(void)
+{
+	return shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+}
+
+/*
+ * the name is predictable, so only a segment we create counts. One already
+ * there was left by a process that had our pid and was killed before
+ * stats_fini, it is replaced if it belongs to us. Someone else's is left
+ * alone and we keep our statistics private.
+ */
+static int open_segment(void)
+{
+	int fd = create_segment();
+	if (fd != -1 || errno != EEXIST) {
+		return fd;
+	}
+	int old = shm_open(shm_name, O_RDONLY | O_CLOEXEC, 0);
+	if (old == -1) {
+		return -1;
+	}
+	struct stat st;
+	bool ours = fstat(old, &st) == 0 && st.st_uid == geteuid();
+	close(old);
+	if (!ours) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (shm_unlink(shm_name) == -1) {
+		return -1;
+	}
+	return create_segment();
+}
+
+/* no malloc in here, it runs from hook_init */
+int stats_init(void)
+{
+	snprintf(shm_name, sizeof(shm_name), STATS_SHM_FMT, getpid());
+	int fd = open_segment();
+	if (fd == -1) {
+		perror("stats_init: shm_open");
+		return EXIT_FAILURE;
+	}
+	if (ftruncate(fd, sizeof(*stats)) == -1) {
+		perror("stats_init: ftruncate");
+		goto cleanup;
+	}
+	void *addr = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("stats_init: mmap");
+		goto cleanup;
+	}
+	close(fd);
+
+	stats = addr;
+	stats->magic = STATS_MAGIC;
+	stats->version = STATS_VERSION;
+	stats->pid = getpid();
+	pthread_atfork(NULL, NULL, stats_atfork_child);
+	return EXIT_SUCCESS;
+
+cleanup:
+	close(fd);
+	shm_unlink(shm_name);
+	return EXIT_FAILURE;
+}
+
+/*
+ * only the name goes away. Threads still running may write to the page
+ * until the process is gone, so it stays mapped.
+ */
+void stats_fini(void)
+{
+	if (stats == &private_stats) {
+		return;
+	}
+	if (shm_unlink(shm_name) == -1) {
+		perror("stats_fini: shm_unlink");
+	}
+}
+
+/* lock held */
+void stats_pause(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	size_t bucket = us == 0 ? 0 : 64 - __builtin_clzl(us);
+	if (bucket >= STATS_PAUSE_BUCKETS) {
+		bucket = STATS_PAUSE_BUCKETS - 1;
+	}
+
+	stats_write_begin();
+	stats->pause_cnt++;
+	stats->pause_ns_total += ns;
+	if (ns > stats->pause_ns_max) {
+		stats->pause_ns_max = ns;
+	}
+	stats->pause_hist[bucket]++;
+	stats_write_end();
+}
@@ -0,0 +1,113 @@
+#ifndef STATS_H
+#define STATS_H
+#define _GNU_SOURCE
+
+/*
+ * GC STATISTICS, PUBLISHED IN A SHARED MEMORY PAGE (/dev/shm/safe_gc.<pid>)
+ * THAT gcstat READS FROM OUTSIDE THE PROCESS. THE COLLECTOR REWRITES THE
+ * SNAPSHOT UNDER ITS LOCK, seq IS ODD WHILE IT DOES. THE FEW COUNTERS BUMPED
+ * OUTSIDE THE LOCK ARE RELAXED ATOMICS. SHARED WITH gcstat.c, KEEP THE
+ * LAYOUT IN SYNC WITH STATS_VERSION.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATS_MAGIC 0x53414645 /* "SAFE" */
+#define STATS_VERSION 3
+#define STATS_SHM_FMT "/safe_gc.%d"
+#define STATS_PAUSE_BUCKETS 32 /* bucket i counts pauses < 2^i us */
+
+struct gc_stats_s {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t seq;
+
+	/* collections, pauses are the stop-the-world part of them */
+	uint64_t collections; /* finished mark cycles */
+	uint64_t full_collections; /* forced by heap pressure */
+	uint64_t reclaims; /* finished sweeps and purges */
+	uint64_t pause_cnt;
+	uint64_t pause_ns_total;
+	uint64_t pause_ns_max;
+	uint64_t pause_hist[STATS_PAUSE_BUCKETS];
+	/* time per phase, in pauses or spread over calls when incremental */
+	uint64_t roots_ns;
+	uint64_t mark_ns;
+	uint64_t sweep_ns;
+
+	/* safe heap */
+	uint64_t live_bytes;
+	uint64_t live_objects;
+	uint64_t pending_cnt; /* free requests not resolved yet */
+	uint64_t pending_bytes;
+	uint64_t heap_limit;
+	uint64_t book_cnt; /* slots handed out, empty ones included */
+	uint64_t book_len;
+	uint64_t free_requests;
+	uint64_t actual_frees;
+	uint64_t blacklist_pages; /* hit by false pointers lately */
+	uint64_t parked; /* blocks kept off blacklisted pages, ever */
+	uint64_t quarantined; /* quarantine mode, blocks freed into it */
+	uint64_t quarantine_releases; /* and handed back from it */
+
+	/* PKRU writes, unsafe_toggles only happen over a mimalloc malloc.
+	 * Safe blocks are counted per thread and summed when published */
+	uint64_t safe_enters;
+	uint64_t safe_exits;
+	uint64_t unsafe_toggles;
+	uint64_t trims;
+};
+
+/* never NULL, points to a private copy when the page couldn't be shared */
+extern struct gc_stats_s *stats;
+
+int stats_init(void);
+void stats_fini(void);
+void stats_pause(uint64_t ns);
+
+/* for readers, the page of pid mapped read-only. NULL with errno set when
+ * there is none */
+static inline const struct gc_stats_s *stats_map(int pid)
+{
+	char name[32];
+	snprintf(name, sizeof(name), STATS_SHM_FMT, pid);
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	void *addr =
+	    mmap(NULL, sizeof(struct gc_stats_s), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void stats_write_begin(void)
+{
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void stats_write_end(void)
+{
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline void stats_count(uint64_t *counter)
+{
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+#endif
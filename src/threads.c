@@ -0,0 +1,296 @@
+#include "threads.h"
+#include "segment_heap.h"
+#include <errno.h>
+#include <semaphore.h>
+
+__thread struct gc_thread_s *thread_self = NULL;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gc_thread_s *threads = NULL;
+static pthread_key_t exit_key;
+static int safe_pkey;
+
+/* handshake state, only touched by the thread holding the lock and by the
+ * handlers of the threads it signaled */
+static bool world_stopped = false;
+static sem_t ack;
+static sigset_t resume_mask;
+
+/* the safe stacks handed to the bookkeeper. Sized when threads register,
+ * a collection may run because the safe heap is full */
+static struct stack_region_s *stacks_buf = NULL;
+static size_t stacks_len = 0;
+static size_t threads_cnt = 0;
+/* safe blocks of the threads that are gone */
+static uint64_t exited_enters = 0;
+static uint64_t exited_exits = 0;
+
+static void suspend_handler(int sig)
+{
+	(void)sig;
+	int saved_errno = errno;
+	struct gc_thread_s *t = thread_self;
+
+	/* handlers start with the default pkru, the record is in the safe
+	 * heap. sigreturn restores the interrupted value */
+	pkey_set(safe_pkey, RDWR);
+
+	/* the kernel saved our registers above this frame */
+	void *here;
+	t->stack.top = PTR_ALIGN_DOWN((uintptr_t *)&here);
+	sem_post(&ack);
+
+	/* SIG_RESUME is blocked until sigsuspend, so it can't be missed */
+	while (__atomic_load_n(&world_stopped, __ATOMIC_ACQUIRE)) {
+		sigsuspend(&resume_mask);
+	}
+	sem_post(&ack);
+	errno = saved_errno;
+}
+
+static void resume_handler(int sig)
+{
+	(void)sig;
+}
+
+/* a thread leaving for good stops being a root. Also, mimalloc's own
+ * teardown walks the thread's heap, which is in the safe heap */
+static void thread_exit(void *arg)
+{
+	struct gc_thread_s *t = (struct gc_thread_s *)arg;
+	int perm = pkey_get(safe_pkey);
+	pkey_set(safe_pkey, RDWR);
+
+	threads_lock();
+	if (threads_flush(t)) {
+		char *err_msg = "ERROR: thread_exit: threads_flush failed\n";
+		write(STDERR_FILENO, err_msg, strlen(err_msg));
+	}
+	struct gc_thread_s **cur = &threads;
+	while (*cur != t) {
+		cur = &(*cur)->next;
+	}
+	*cur = t->next;
+	threads_cnt--;
+	exited_enters += t->enters;
+	exited_exits += t->exits;
+	threads_unlock();
+
+	for (size_t i = 0; i < t->parked_cnt; i++) {
+		mi_free(t->parked[i]);
+	}
+	quarantine_fini(&t->quarantine);
+	thread_self = NULL;
+	mi_free(t);
+	/* mimalloc's own destructor is a no-op after this */
+	mi_thread_done();
+	pkey_set(safe_pkey, perm);
+}
+
+int threads_init(int pkey)
+{
+	safe_pkey = pkey;
+	if (sem_init(&ack, 0, 0) == -1) {
+		perror("threads_init: sem_init");
+		return EXIT_FAILURE;
+	}
+	int err = pthread_key_create(&exit_key, thread_exit);
+	if (err != 0) {
+		errno = err;
+		perror("threads_init: pthread_key_create");
+		return EXIT_FAILURE;
+	}
+
+	sigfillset(&resume_mask);
+	sigdelset(&resume_mask, SIG_RESUME);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_RESTART;
+	sa.sa_handler = suspend_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaddset(&sa.sa_mask, SIG_RESUME);
+	if (sigaction(SIG_SUSPEND, &sa, NULL) == -1) {
+		perror("threads_init: sigaction");
+		return EXIT_FAILURE;
+	}
+	sa.sa_handler = resume_handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIG_RESUME, &sa, NULL) == -1) {
+		perror("threads_init: sigaction");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* called by the thread itself, the record lives in its heap */
+struct gc_thread_s *threads_register(mi_heap_t *heap)
+{
+	struct gc_thread_s *t = mi_heap_calloc(heap, 1, sizeof(*t));
+	if (t == NULL) {
+		perror("threads_register: mi_heap_calloc");
+		return NULL;
+	}
+	t->heap = heap;
+	t->tid = pthread_self();
+
+	threads_lock();
+	if (threads_cnt == stacks_len) {
+		size_t len = stacks_len == 0 ? 8 : stacks_len * 2;
+		void *tmp =
+		    mi_heap_realloc(heap, stacks_buf, len * sizeof(*stacks_buf));
+		if (tmp == NULL) {
+			threads_unlock();
+			perror("threads_register: mi_heap_realloc");
+			mi_free(t);
+			return NULL;
+		}
+		stacks_buf = tmp;
+		stacks_len = len;
+	}
+	threads_cnt++;
+	t->next = threads;
+	threads = t;
+	threads_unlock();
+
+	thread_self = t;
+	pthread_setspecific(exit_key, t);
+	return t;
+}
+
+void threads_lock(void)
+{
+	pthread_mutex_lock(&lock);
+}
+
+void threads_unlock(void)
+{
+	pthread_mutex_unlock(&lock);
+}
+
+/* hands the buffered allocations, then the free requests, to the
+ * bookkeeper. Lock held, and t is either the caller or stopped */
+int threads_flush(struct gc_thread_s *t)
+{
+	size_t cnt = __atomic_load_n(&t->adds_cnt, __ATOMIC_ACQUIRE);
+	for (size_t i = t->adds_flushed; i < cnt; i++) {
+		if (bookkeeper_add(t->adds_addr[i], t->adds_size[i],
+				   t->adds_noscan[i])) {
+			return EXIT_FAILURE;
+		}
+	}
+	t->adds_flushed = cnt;
+
+	cnt = __atomic_load_n(&t->frees_cnt, __ATOMIC_ACQUIRE);
+	for (size_t i = t->frees_flushed; i < cnt; i++) {
+		if (bookkeeper_request_free(t->frees[i])) {
+			return EXIT_FAILURE;
+		}
+	}
+	t->frees_flushed = cnt;
+
+	/* only the owner may start the buffers over */
+	if (t == thread_self) {
+		t->adds_cnt = t->adds_flushed = 0;
+		t->frees_cnt = t->frees_flushed = 0;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * stops every other thread in a safe block, they can't be touching the
+ * bookkeeper since the lock is held. Their buffers are flushed once they
+ * all acked.
+ */
+int threads_stop_world(void)
+{
+	__atomic_store_n(&world_stopped, true, __ATOMIC_RELEASE);
+
+	size_t cnt = 0;
+	for (struct gc_thread_s *t = threads; t != NULL; t = t->next) {
+		if (t == thread_self || !t->in_safe_block) {
+			continue;
+		}
+		int err = pthread_kill(t->tid, SIG_SUSPEND);
+		if (err != 0) {
+			errno = err;
+			perror("threads_stop_world: pthread_kill");
+			return EXIT_FAILURE;
+		}
+		t->stopped = true;
+		cnt++;
+	}
+
+	for (size_t i = 0; i < cnt; i++) {
+		while (sem_wait(&ack) == -1) {
+			if (errno != EINTR) {
+				perror("threads_stop_world: sem_wait");
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	for (struct gc_thread_s *t = threads; t != NULL; t = t->next) {
+		if ((t == thread_self || t->stopped) && threads_flush(t)) {
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+int threads_start_world(void)
+{
+	__atomic_store_n(&world_stopped, false, __ATOMIC_RELEASE);
+
+	size_t cnt = 0;
+	for (struct gc_thread_s *t = threads; t != NULL; t = t->next) {
+		if (!t->stopped) {
+			continue;
+		}
+		t->stopped = false;
+		int err = pthread_kill(t->tid, SIG_RESUME);
+		if (err != 0) {
+			errno = err;
+			perror("threads_start_world: pthread_kill");
+			return EXIT_FAILURE;
+		}
+		cnt++;
+	}
+
+	/* wait for everyone to leave the handler, otherwise the next stop
+	 * could find a thread that never went back to running */
+	for (size_t i = 0; i < cnt; i++) {
+		while (sem_wait(&ack) == -1) {
+			if (errno != EINTR) {
+				perror("threads_start_world: sem_wait");
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/* lock held. Safe blocks entered and left by all threads so far */
+void threads_safe_blocks(uint64_t *enters, uint64_t *exits)
+{
+	*enters = exited_enters;
+	*exits = exited_exits;
+	for (struct gc_thread_s *t = threads; t != NULL; t = t->next) {
+		*enters += t->enters;
+		*exits += t->exits;
+	}
+}
+
+/* the safe stacks of the caller and of every stopped thread */
+int threads_stacks(struct stack_region_s **stacks, size_t *cnt)
+{
+	size_t n = 0;
+	for (struct gc_thread_s *t = threads; t != NULL; t = t->next) {
+		if (t == thread_self || t->stopped) {
+			stacks_buf[n++] = t->stack;
+		}
+	}
+	*stacks = stacks_buf;
+	*cnt = n;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,66 @@
+#ifndef THREADS_H
+#define THREADS_H
+#define _GNU_SOURCE
+
+/*
+ * REGISTRY OF THE THREADS USING SAFE BLOCKS AND THE STOP-THE-WORLD
+ * HANDSHAKE. THE COLLECTING THREAD SENDS SIG_SUSPEND, EACH TARGET RECORDS
+ * WHERE ITS STACK ENDS (SAVED REGISTERS INCLUDED), ACKS AND WAITS IN
+ * sigsuspend UNTIL SIG_RESUME. ONE LOCK SERIALIZES THE BOOKKEEPER.
+ */
+
+#include "bookkeeper.h"
+#include "quarantine.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+
+#define SIG_SUSPEND SIGPWR
+#define SIG_RESUME SIGXCPU
+
+/* allocations and free requests a thread buffers before taking the lock */
+#define THREAD_BUF_LEN 64
+/* blocks a thread keeps out of use because they sit on blacklisted pages */
+#define THREAD_PARK_LEN 32
+
+struct gc_thread_s {
+	struct stack_region_s stack; /* top is only valid while collecting */
+	mi_heap_t *heap;
+	pthread_t tid;
+	bool in_safe_block; /* only changes under the lock */
+	bool stopped;
+	size_t calls; /* hooked calls since the last sync */
+	uint64_t trimmed; /* bookkeeper_reclaims at the last trim of heap */
+	/* safe blocks entered and left, only change under the lock */
+	uint64_t enters;
+	uint64_t exits;
+	/* [flushed, cnt) is not in the bookkeeper yet. cnt is only bumped by
+	 * the owner, flushed only moves under the lock */
+	size_t adds_cnt;
+	size_t adds_flushed;
+	void *adds_addr[THREAD_BUF_LEN];
+	size_t adds_size[THREAD_BUF_LEN];
+	bool adds_noscan[THREAD_BUF_LEN];
+	size_t frees_cnt;
+	size_t frees_flushed;
+	void *frees[THREAD_BUF_LEN];
+	/* owner only, looked at again once the blacklist changed */
+	size_t parked_cnt;
+	uint64_t parked_gen;
+	void *parked[THREAD_PARK_LEN];
+	struct quarantine_s quarantine; /* owner only */
+	struct gc_thread_s *next;
+};
+
+extern __thread struct gc_thread_s *thread_self;
+
+int threads_init(int pkey);
+struct gc_thread_s *threads_register(mi_heap_t *heap);
+void threads_lock(void);
+void threads_unlock(void);
+int threads_flush(struct gc_thread_s *t);
+int threads_stop_world(void);
+int threads_start_world(void);
+void threads_safe_blocks(uint64_t *enters, uint64_t *exits);
+int threads_stacks(struct stack_region_s **stacks, size_t *cnt);
+#endif
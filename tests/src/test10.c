@@ -0,0 +1,59 @@
+#include "safe_blocks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the only reference to the string is in the returned block */
+static __attribute__((noinline)) char **make_refs(void)
+{
+	char **refs = malloc(2 * sizeof(char *));
+	refs[0] = malloc(32);
+	strcpy(refs[0], "held through realloc");
+	refs[1] = NULL;
+	free(refs[0]);
+	return refs;
+}
+
+/* pointer-free blocks are never scanned, but refs to them still keep them
+ * from being reused after free */
+int main()
+{
+	ENTER_SAFE_BLOCK;
+
+	char **names = malloc(2 * sizeof(char *));
+	names[0] = MALLOC_NOSCAN(32);
+	strcpy(names[0], "noscan buffer");
+	NOSCAN(names[1] = strdup("strdup'd under NOSCAN"));
+	char *old0 = names[0];
+	char *old1 = names[1];
+	free(names[0]);
+	free(names[1]);
+
+	/* try to get the freed blocks reused */
+	for (int i = 0; i < 4096; i++) {
+		char *p = CALLOC_NOSCAN(32, 1);
+		memset(p, 'A', 31);
+		free(p);
+	}
+	if (strcmp(old0, "noscan buffer") != 0 ||
+	    strcmp(old1, "strdup'd under NOSCAN") != 0) {
+		fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+	}
+	free(names);
+
+	/* a block moved by realloc keeps its noscan bit, the NOSCAN scope
+	 * only applies to new allocations */
+	char **refs = make_refs();
+	NOSCAN(refs = realloc(refs, 64 * 1024));
+	for (int i = 0; i < 4096; i++) {
+		char *p = calloc(32, 1);
+		memset(p, 'B', 31);
+		free(p);
+	}
+	if (strcmp(refs[0], "held through realloc") != 0) {
+		fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+	}
+	free(refs);
+
+	EXIT_SAFE_BLOCK;
+}
@@ -0,0 +1,49 @@
+#include "safe_blocks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BODY_SIZE (4 * 1024 * 1024)
+
+/* multi-MB buffers live in the large object space, a reachable one must
+ * survive its free while the following ones come and go */
+int main()
+{
+	ENTER_SAFE_BLOCK;
+
+	char *body = malloc(BODY_SIZE);
+	memset(body, 'B', BODY_SIZE);
+	free(body);
+
+	for (int i = 0; i < 512; i++) {
+		char *p = i % 2 ? calloc(1, BODY_SIZE) : malloc(BODY_SIZE);
+		if (p == NULL) {
+			fprintf(stderr, "large allocation failed\n");
+			return 1;
+		}
+		if (i % 2 && p[BODY_SIZE - 1] != 0) {
+			fprintf(stderr, "calloc'd block is not zeroed\n");
+			return 1;
+		}
+		memset(p, 'A', BODY_SIZE);
+		free(p);
+	}
+	if (body[0] != 'B' || body[BODY_SIZE - 1] != 'B') {
+		fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+	}
+
+	/* grow one past the threshold and back */
+	char *s = malloc(64);
+	strcpy(s, "grown");
+	s = realloc(s, 2 * BODY_SIZE);
+	s = realloc(s, 128);
+	if (strcmp(s, "grown") != 0) {
+		fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+	}
+	free(s);
+	TRIM_SAFE_HEAP;
+
+	EXIT_SAFE_BLOCK;
+	/* load dropped, give the pages back from outside as well */
+	TRIM_SAFE_HEAP;
+}
@@ -0,0 +1,49 @@
+#include "safe_blocks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEAP_SIZE (256UL * 1024 * 1024) /* SAFE_GC_HEAP_SIZE, see test.py */
+#define BLOCK_SIZE (1024 * 1024)
+#define MAX_BLOCKS (2 * HEAP_SIZE / BLOCK_SIZE)
+
+/* a small safe heap that fills up, allocations fail once forced
+ * collections can't make room and work again once blocks are freed */
+int main()
+{
+	ENTER_SAFE_BLOCK;
+
+	static char *blocks[MAX_BLOCKS];
+	size_t cnt = 0;
+	while (cnt < MAX_BLOCKS) {
+		blocks[cnt] = malloc(BLOCK_SIZE);
+		if (blocks[cnt] == NULL) {
+			break;
+		}
+		memset(blocks[cnt], 'A', BLOCK_SIZE);
+		cnt++;
+	}
+	if (cnt == MAX_BLOCKS) {
+		fprintf(stderr, "safe heap never filled up\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < cnt; i++) {
+		free(blocks[i]);
+		blocks[i] = NULL;
+	}
+	char *p = NULL;
+	for (int i = 0; i < 1024 && p == NULL; i++) {
+		/* frees are only acted on by later calls */
+		free(malloc(16));
+		p = malloc(BLOCK_SIZE);
+	}
+	if (p == NULL) {
+		fprintf(stderr, "safe heap never recovered\n");
+		return 1;
+	}
+	free(p);
+
+	EXIT_SAFE_BLOCK;
+	printf("%zu blocks before the heap was full\n", cnt);
+}
@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include "safe_blocks.h"
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NODES 64
+
+struct node_s {
+	struct node_s *next;
+	char tag[48];
+};
+
+static int aligned(void *p, size_t align)
+{
+	return ((uintptr_t)p & (align - 1)) == 0;
+}
+
+/* aligned blocks come from the safe heap: a free block still referenced
+ * from one of them must survive the following allocations */
+int main()
+{
+	ENTER_SAFE_BLOCK;
+
+	void *bufs[6];
+	if (posix_memalign(&bufs[0], 64, 256) != 0) {
+		fprintf(stderr, "posix_memalign failed\n");
+		return 1;
+	}
+	bufs[1] = aligned_alloc(4096, 8192);
+	bufs[2] = memalign(128, 100);
+	bufs[3] = valloc(1000);
+	bufs[4] = pvalloc(1000);
+	bufs[5] = reallocarray(NULL, 16, sizeof(struct node_s));
+	size_t aligns[] = {64, 4096, 128, 4096, 4096, 16};
+	for (int i = 0; i < 6; i++) {
+		if (bufs[i] == NULL || !aligned(bufs[i], aligns[i])) {
+			fprintf(stderr, "bad block %d: %p\n", i, bufs[i]);
+			return 1;
+		}
+	}
+	if (malloc_usable_size(bufs[4]) < 4096) {
+		fprintf(stderr, "pvalloc'd block is not a page\n");
+		return 1;
+	}
+
+	/* a ref kept in the slack past the requested size */
+	char *small = memalign(64, 8);
+	size_t usable = malloc_usable_size(small);
+	struct node_s **slot = (struct node_s **)(small + usable - sizeof(void *));
+
+	struct node_s *head = NULL;
+	for (int i = 0; i < NODES; i++) {
+		struct node_s *n = malloc(sizeof(*n));
+		strcpy(n->tag, "linked");
+		n->next = head;
+		head = n;
+	}
+	memcpy(bufs[0], &head, sizeof(head));
+	*slot = head->next;
+	head->next = NULL;
+	head = NULL;
+
+	/* hidden from the stack, only reachable through aligned blocks */
+	struct node_s *first;
+	memcpy(&first, bufs[0], sizeof(first));
+	free(*slot);
+	free(first);
+	first = NULL;
+	for (int i = 0; i < 100000; i++) {
+		char *p = aligned_alloc(64, sizeof(struct node_s));
+		memset(p, 'A', sizeof(struct node_s));
+		free(p);
+	}
+	memcpy(&first, bufs[0], sizeof(first));
+	if (strcmp(first->tag, "linked") != 0 ||
+	    strcmp((*slot)->tag, "linked") != 0) {
+		fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+	}
+
+	for (int i = 0; i < 6; i++) {
+		free(bufs[i]);
+	}
+	free(small);
+	EXIT_SAFE_BLOCK;
+
+	/* outside, the default allocator answers */
+	void *p = aligned_alloc(64, 64);
+	if (p == NULL || !aligned(p, 64) || malloc_usable_size(p) < 64) {
+		fprintf(stderr, "unsafe aligned_alloc failed\n");
+		return 1;
+	}
+	free(p);
+}
@@ -0,0 +1,65 @@
+#include "safe_blocks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NODES 1000
+#define CHURN 20000
+#define CHUNK_SIZE (64 * 1024)
+
+struct node_s {
+	struct node_s *next;
+	size_t val;
+};
+
+/* marking in a forked child: reachable objects survive their free while
+ * garbage churns through a heap it would fill many times over, and a fork
+ * of the program itself still works */
+int main()
+{
+	ENTER_SAFE_BLOCK;
+
+	struct node_s *head = NULL;
+	for (size_t i = 0; i < NODES; i++) {
+		struct node_s *n = malloc(sizeof(*n));
+		n->next = head;
+		n->val = i;
+		head = n;
+		free(n);
+	}
+
+	for (size_t i = 0; i < CHURN; i++) {
+		char *p = malloc(CHUNK_SIZE);
+		if (p == NULL) {
+			fprintf(stderr, "garbage was never reclaimed\n");
+			return 1;
+		}
+		memset(p, 'A', CHUNK_SIZE);
+		free(p);
+	}
+
+	size_t i = NODES;
+	for (struct node_s *n = head; n != NULL; n = n->next) {
+		if (n->val != --i) {
+			fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+			return 1;
+		}
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		free(malloc(16));
+		_exit(0);
+	}
+	int status;
+	if (pid == -1 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "forked child failed\n");
+		return 1;
+	}
+
+	EXIT_SAFE_BLOCK;
+	printf("%zu nodes survived the churn\n", (size_t)NODES);
+}
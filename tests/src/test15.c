@@ -0,0 +1,48 @@
+#include "safe_blocks.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (2 * 1024 * 1024)
+#define CHURN 100000
+#define KEY 0x5a5a5a5a5a5aUL
+
+/* an integer that happens to look like a safe heap address */
+static uintptr_t false_ptr;
+
+static void churn(void)
+{
+	for (int i = 0; i < CHURN; i++) {
+		free(malloc(16));
+	}
+}
+
+/* a block freed for good leaves a false pointer behind, the collector
+ * must keep the next block of the same size off its pages */
+int main()
+{
+	ENTER_SAFE_BLOCK;
+
+	char *block = malloc(BLOCK_SIZE);
+	memset(block, 'A', BLOCK_SIZE);
+	/* no copy the scanner could take for a pointer */
+	volatile uintptr_t hidden = (uintptr_t)block ^ KEY;
+	free(block);
+	block = NULL;
+	churn();
+
+	false_ptr = (hidden ^ KEY) + BLOCK_SIZE / 2;
+	churn();
+
+	char *next = malloc(BLOCK_SIZE);
+	if ((uintptr_t)next <= false_ptr &&
+	    false_ptr < (uintptr_t)next + BLOCK_SIZE) {
+		fprintf(stderr, "new block placed under a false pointer\n");
+		return 1;
+	}
+	free(next);
+
+	EXIT_SAFE_BLOCK;
+	printf("false pointer at %p avoided\n", (void *)false_ptr);
+}
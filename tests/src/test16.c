@@ -0,0 +1,126 @@
+#include "safe_blocks.h"
+#include "stats.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BUDGET (1024 * 1024) /* SAFE_GC_QUARANTINE, see test.py */
+#define SIZE 64
+#define HELD (BUDGET / 2 / SIZE)
+#define CHURN (64 * 1024 * 1024 / SIZE)
+
+static char *held[HELD];
+static char *after[2 * BUDGET / SIZE];
+
+static int cmp_ptr(const void *a, const void *b)
+{
+	uintptr_t x = *(const uintptr_t *)a;
+	uintptr_t y = *(const uintptr_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void churn(size_t size, size_t cnt)
+{
+	for (size_t i = 0; i < cnt; i++) {
+		char *p = malloc(size);
+		p[0] = 'B';
+		free(p);
+	}
+}
+
+/* quarantine mode, no tracing: a freed block reads as zeros and isn't
+ * reused until the budget pushes it out. Frees of pointers that aren't
+ * allocated blocks are ignored, even once the block went back to mimalloc */
+int main()
+{
+	ENTER_SAFE_BLOCK;
+
+	char *victim = malloc(SIZE);
+	memset(victim, 'V', SIZE);
+	free(victim);
+	free(victim);
+	for (int i = 0; i < SIZE; i++) {
+		if (victim[i] != 0) {
+			fprintf(stderr, "quarantined block not cleared\n");
+			return 1;
+		}
+	}
+
+	for (size_t i = 0; i < HELD; i++) {
+		held[i] = malloc(SIZE);
+		memset(held[i], 'A', SIZE);
+		if (held[i] == victim) {
+			fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+			return 1;
+		}
+	}
+	/* not the start of a block */
+	free(held[0] + sizeof(uintptr_t));
+
+	/* many times the budget goes through */
+	churn(SIZE, CHURN);
+	const struct gc_stats_s *st = stats_map(getpid());
+	if (st == NULL) {
+		perror("stats_map");
+		return 1;
+	}
+	if (st->quarantined < CHURN ||
+	    st->quarantined - st->quarantine_releases > BUDGET / SIZE + 1) {
+		fprintf(stderr, "quarantine kept more than its budget\n");
+		return 1;
+	}
+	if (held[0][SIZE - 1] != 'A') {
+		fprintf(stderr, "interior pointer freed its block\n");
+		return 1;
+	}
+
+	/* pushed back to mimalloc by blocks of another size, so that nothing
+	 * reuses it. Freeing it again must not hand it out twice */
+	victim = malloc(SIZE);
+	free(victim);
+	churn(2 * SIZE, BUDGET / SIZE);
+	free(victim);
+	churn(2 * SIZE, BUDGET / SIZE);
+	size_t cnt = sizeof(after) / sizeof(after[0]);
+	for (size_t i = 0; i < cnt; i++) {
+		after[i] = malloc(SIZE);
+	}
+	qsort(after, cnt, sizeof(after[0]), cmp_ptr);
+	for (size_t i = 1; i < cnt; i++) {
+		if (after[i] == after[i - 1]) {
+			fprintf(stderr, "block handed out twice: %p\n",
+				after[i]);
+			return 1;
+		}
+	}
+	for (size_t i = 0; i < cnt; i++) {
+		free(after[i]);
+	}
+
+	char *s = malloc(16);
+	strcpy(s, "grown");
+	s = realloc(s, 2 * 1024 * 1024);
+	if (strcmp(s, "grown") != 0) {
+		fprintf(stderr, "realloc lost the contents\n");
+		return 1;
+	}
+	free(s);
+
+	/* everything allocated goes, the held blocks are handed out again */
+	PURGE_BLOCK;
+	qsort(held, HELD, sizeof(held[0]), cmp_ptr);
+	size_t reused = 0;
+	for (size_t i = 0; i < HELD; i++) {
+		after[i] = malloc(SIZE);
+		reused += bsearch(&after[i], held, HELD, sizeof(held[0]),
+				  cmp_ptr) != NULL;
+	}
+	if (reused == 0) {
+		fprintf(stderr, "purge left the blocks allocated\n");
+		return 1;
+	}
+	EXIT_SAFE_BLOCK;
+	printf("quarantine held and released\n");
+}
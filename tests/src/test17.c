@@ -0,0 +1,53 @@
+#include "safe_blocks.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define THREADS 16
+#define ROUNDS 2000
+#define BLOCK_SIZE (1024 * 1024) /* SAFE_GC_LARGE_MIN, own pages */
+#define KEEP 4
+
+/* large blocks on a small heap (see test.py): full collections keep
+ * sweeping large blocks while the other threads are stopped in the middle
+ * of allocating or freeing one. A kept block being reused would change its
+ * first byte */
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	ENTER_SAFE_BLOCK;
+
+	char *keep[KEEP] = {0};
+	for (int i = 0; i < ROUNDS; i++) {
+		char *p = malloc(BLOCK_SIZE);
+		if (p == NULL) {
+			continue;
+		}
+		p[0] = (char)id;
+		p[BLOCK_SIZE - 1] = (char)id;
+		if (keep[i % KEEP] != NULL && keep[i % KEEP][0] != (char)id) {
+			fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+			break;
+		}
+		free(keep[i % KEEP]);
+		keep[i % KEEP] = p;
+	}
+	for (int i = 0; i < KEEP; i++) {
+		free(keep[i]);
+	}
+
+	EXIT_SAFE_BLOCK;
+	return NULL;
+}
+
+int main()
+{
+	pthread_t threads[THREADS];
+	for (long i = 0; i < THREADS; i++) {
+		pthread_create(&threads[i], NULL, worker, (void *)i);
+	}
+	for (int i = 0; i < THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	printf("%d threads done\n", THREADS);
+}
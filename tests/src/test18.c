@@ -0,0 +1,44 @@
+#include "safe_blocks.h"
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BIG_SIZE (5UL * 1024 * 1024 * 1024) /* SAFE_GC_LARGE_SPACE, test.py */
+#define ROUNDS 100000
+
+/* a block too big for the 32-bit book sizes lives in the large object
+ * space. All of it is tracked: it survives collections while referenced,
+ * and the pages it spans aren't handed out twice */
+int main()
+{
+	ENTER_SAFE_BLOCK;
+
+	char *big = malloc(BIG_SIZE);
+	if (big == NULL) {
+		fprintf(stderr, "big allocation failed\n");
+		return 1;
+	}
+	if (malloc_usable_size(big) < BIG_SIZE) {
+		fprintf(stderr, "big allocation is short\n");
+		return 1;
+	}
+	big[0] = 'A';
+	big[BIG_SIZE - 1] = 'Z';
+
+	for (int i = 0; i < ROUNDS; i++) {
+		free(malloc(64));
+	}
+	char *other = malloc(BIG_SIZE);
+	if (other != NULL && other < big + BIG_SIZE &&
+	    other + BIG_SIZE > big) {
+		fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+	}
+	if (big[0] != 'A' || big[BIG_SIZE - 1] != 'Z') {
+		fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+	}
+	free(other);
+	free(big);
+
+	EXIT_SAFE_BLOCK;
+	printf("%lu bytes in one block\n", BIG_SIZE);
+}
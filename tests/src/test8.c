@@ -0,0 +1,55 @@
+#include "safe_blocks.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define THREADS 4
+#define ROUNDS 20000
+
+struct node {
+	struct node *next;
+	long val;
+};
+
+/* each thread keeps a list alive on its own safe stack while it frees a
+ * lot of garbage, so collections keep stopping the other threads. A node
+ * of a live list being reused would change its val */
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	ENTER_SAFE_BLOCK;
+
+	struct node *head = NULL;
+	for (int i = 0; i < ROUNDS; i++) {
+		struct node *n = malloc(sizeof(struct node));
+		n->val = id;
+		if (i % 16 == 0) {
+			n->next = head;
+			head = n;
+			continue;
+		}
+		free(n);
+	}
+
+	for (struct node *n = head; n != NULL; n = n->next) {
+		if (n->val != id) {
+			fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+			break;
+		}
+	}
+
+	EXIT_SAFE_BLOCK;
+	return NULL;
+}
+
+int main()
+{
+	pthread_t threads[THREADS];
+	for (long i = 0; i < THREADS; i++) {
+		pthread_create(&threads[i], NULL, worker, (void *)i);
+	}
+	for (int i = 0; i < THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	printf("%d threads done\n", THREADS);
+}
@@ -0,0 +1,44 @@
+#include "safe_blocks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* a realloc that moves the block must not hand the old one back to the
+ * allocator while the program can still reach it */
+int main()
+{
+	ENTER_SAFE_BLOCK;
+
+	char *buf = malloc(16);
+	strcpy(buf, "safe blocks");
+	char *old = buf;
+	size_t len = 16;
+	while (buf == old) {
+		len *= 2;
+		buf = realloc(buf, len);
+	}
+
+	/* try to get the old block reused */
+	for (int i = 0; i < 4096; i++) {
+		char *p = malloc(16);
+		memset(p, 'A', 16);
+		free(p);
+	}
+	if (strcmp(old, "safe blocks") != 0 || strcmp(buf, old) != 0) {
+		fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+	}
+
+	/* string builder, grows a byte at a time */
+	char *s = NULL;
+	for (size_t i = 0; i < 100000; i++) {
+		s = realloc(s, i + 2);
+		s[i] = 'a' + i % 26;
+		s[i + 1] = '\0';
+	}
+	if (strlen(s) != 100000) {
+		fprintf(stderr, "REPORT_UAF_OCCURED_REPORT\n");
+	}
+	free(s);
+
+	EXIT_SAFE_BLOCK;
+}
@@ -33,6 +33,16 @@ if __name__ == "__main__":
         "test3": "auth admin\nreset\nservice " + "A" * 28 + "\nlogin\n",
     }
 
+    # the runtime reads its config when it is loaded, set it up front
+    test_env = {
+        "test12": {"SAFE_GC_HEAP_SIZE": "256M", "SAFE_GC_OOM": "0"},
+        "test14": {"SAFE_GC_FORK": "1", "SAFE_GC_HEAP_SIZE": "64M",
+                   "SAFE_GC_OOM": "0"},
+        "test16": {"SAFE_GC_QUARANTINE": "1M", "SAFE_GC_STATS": "1"},
+        "test17": {"SAFE_GC_HEAP_SIZE": "64M", "SAFE_GC_OOM": "0"},
+        "test18": {"SAFE_GC_HEAP_MAX": "16G", "SAFE_GC_LARGE_SPACE": "12G"},
+    }
+
     total_cnt = 0
     total_success = 0
 
@@ -46,8 +56,8 @@ if __name__ == "__main__":
 
         # compile the test case
         print(f"INFO: compile {test_file} -> {binary_path}")
-        compile_cmd = ["clang", "-ggdb3", test_file, "-I" + header_dir,
-                       "-o", binary_path]
+        compile_cmd = ["clang", "-ggdb3", "-pthread", test_file,
+                       "-I" + header_dir, "-o", binary_path]
         result = subprocess.run(compile_cmd, capture_output=True, text=True)
 
         if result.returncode != 0:
@@ -59,6 +69,7 @@ if __name__ == "__main__":
         print(f"INFO: running {test_name}...")
         env = os.environ.copy()
         env["LD_PRELOAD"] = runtime_path
+        env.update(test_env.get(test_name, {}))
 
         input_data = test_inputs.get(test_name, None)  # get input if defined
         # need to fflush stdout of target file to fully capture output